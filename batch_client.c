@@ -0,0 +1,239 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "libdfegrpc.h"
+
+struct batch_options {
+    const char *key;
+    const char *project_id;
+    const char *endpoint;
+    const char *model;
+    int single_utterance;
+    int debug;
+    FILE *output;
+};
+
+static int verbose = 0;
+
+static void batch_log(enum dialogflow_log_level level, const char *file, int line, const char *function, const char *fmt, va_list args)
+{
+    const char *levels[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+    if (level < DF_LOG_LEVEL_DEBUG || level > DF_LOG_LEVEL_ERROR) {
+        level = DF_LOG_LEVEL_ERROR;
+    }
+    if (level < DF_LOG_LEVEL_WARNING && !verbose) {
+        return;
+    }
+
+    fprintf(stderr, "[%s] (%s:%d) ", levels[level], file, line);
+    vfprintf(stderr, fmt, args);
+}
+
+static int setup_session(void *user_data, const struct dialogflow_batch_item *item, struct dialogflow_session *session)
+{
+    struct batch_options *options = user_data;
+
+    if (df_set_auth_key(session, options->key) || df_set_project_id(session, options->project_id)) {
+        return -1;
+    }
+    if (options->endpoint) {
+        df_set_endpoint(session, options->endpoint);
+    }
+    if (options->model) {
+        df_set_model(session, options->model);
+    }
+    df_set_debug(session, options->debug);
+    /* the whole recording is one turn unless asked to stop at the first utterance */
+    df_set_use_external_endpointer(session, !options->single_utterance);
+    return 0;
+}
+
+static void write_result(void *user_data, const struct dialogflow_batch_item *item, const char *json)
+{
+    struct batch_options *options = user_data;
+
+    fprintf(options->output, "%s\n", json);
+    fflush(options->output);
+}
+
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char *buffer;
+    long length;
+
+    if (!f) {
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buffer = malloc(length + 1);
+    if (buffer) {
+        length = fread(buffer, 1, length, f);
+        buffer[length] = '\0';
+    }
+    fclose(f);
+    return buffer;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: batch_client -k keyfile -p projectid [-c concurrency] [-l language] [-m model] [-e endpoint]\n"
+                    "                    [-o output] [-f listfile] [-s] [-d] [audiofile...]\n"
+                    "streams each audio file (and each file named in listfile, one per line) as fast as the\n"
+                    "server takes it, writing one line of JSON per file to output\n");
+}
+
+/* program -k keyfile -p projectid audiofile... */
+int main(int argc, char *argv[])
+{
+    struct batch_options options = { NULL, NULL, NULL, NULL, 0, 0, stdout };
+    const char *keyfile = NULL;
+    const char *language = NULL;
+    const char *outputfile = NULL;
+    const char *listfile = NULL;
+    char *keybuffer = NULL;
+    char *listbuffer = NULL;
+    size_t concurrency = 0;
+    struct dialogflow_batch_item *items;
+    size_t item_count = 0;
+    struct timeval start, end;
+    int failures;
+    int i;
+    int c;
+
+    while ((c = getopt(argc, argv, "k:p:c:l:m:e:o:f:sdv")) != -1) {
+        switch (c) {
+            case 'k':
+                keyfile = optarg;
+                break;
+            case 'p':
+                options.project_id = optarg;
+                break;
+            case 'c':
+                concurrency = (size_t) atoi(optarg);
+                break;
+            case 'l':
+                language = optarg;
+                break;
+            case 'm':
+                options.model = optarg;
+                break;
+            case 'e':
+                options.endpoint = optarg;
+                break;
+            case 'o':
+                outputfile = optarg;
+                break;
+            case 'f':
+                listfile = optarg;
+                break;
+            case 's':
+                options.single_utterance = 1;
+                break;
+            case 'd':
+                options.debug = 1;
+                verbose = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage();
+                return 5;
+        }
+    }
+
+    if (!keyfile || !options.project_id) {
+        usage();
+        return 6;
+    }
+
+    if (strchr(keyfile, '{')) {
+        options.key = keyfile;
+    } else {
+        keybuffer = read_file(keyfile);
+        if (!keybuffer) {
+            fprintf(stderr, "Unable to read %s -- %d\n", keyfile, errno);
+            return 10;
+        }
+        options.key = keybuffer;
+    }
+
+    items = calloc(argc - optind + 1, sizeof(*items));
+    if (!items) {
+        return 11;
+    }
+    for (i = optind; i < argc; i++) {
+        items[item_count].name = argv[i];
+        items[item_count].path = argv[i];
+        item_count++;
+    }
+    if (listfile) {
+        char *line;
+        size_t listed = 0;
+        listbuffer = read_file(listfile);
+        if (!listbuffer) {
+            fprintf(stderr, "Unable to read %s -- %d\n", listfile, errno);
+            return 12;
+        }
+        for (line = listbuffer; *line; line++) {
+            listed += (*line == '\n');
+        }
+        items = realloc(items, (item_count + listed + 1) * sizeof(*items));
+        if (!items) {
+            return 11;
+        }
+        for (line = strtok(listbuffer, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+            if (*line) {
+                memset(&items[item_count], 0, sizeof(*items));
+                items[item_count].name = line;
+                items[item_count].path = line;
+                item_count++;
+            }
+        }
+    }
+    if (item_count == 0) {
+        usage();
+        return 8;
+    }
+
+    if (outputfile) {
+        options.output = fopen(outputfile, "w");
+        if (!options.output) {
+            fprintf(stderr, "Unable to open %s -- %d\n", outputfile, errno);
+            return 15;
+        }
+    }
+
+    if (df_init(batch_log, NULL)) {
+        fprintf(stderr, "Failure initializing library\n");
+        return 20;
+    }
+
+    gettimeofday(&start, NULL);
+    failures = df_recognize_batch(items, item_count, concurrency, language, setup_session, write_result, &options);
+    gettimeofday(&end, NULL);
+
+    fprintf(stderr, "%d files, %d failed, %.1f seconds\n", (int) item_count, failures,
+        (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
+
+    df_shutdown();
+
+    if (options.output != stdout) {
+        fclose(options.output);
+    }
+    free(listbuffer);
+    free(keybuffer);
+    free(items);
+
+    return failures ? 1 : 0;
+}
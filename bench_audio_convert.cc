@@ -0,0 +1,75 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include "libdfegrpc_audio.h"
+
+/* time each set of conversion kernels and the resampler on the same audio, checking the kernels agree with the
+   scalar ones along the way. usage: bench_audio_convert [samples] [iterations] */
+
+template<typename F> static double time_ns(F body, int iterations)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        body();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    size_t samples = argc > 1 ? (size_t) atoi(argv[1]) : 160;
+    int iterations = argc > 2 ? atoi(argv[2]) : 200000;
+
+    std::vector<uint8_t> companded(samples);
+    std::vector<int16_t> linear(samples);
+    for (size_t i = 0; i < samples; i++) {
+        companded[i] = (uint8_t) (i * 37);
+        linear[i] = (int16_t) (i * 4099);
+    }
+
+    const struct df_audio_kernels *scalar = df_audio_kernels_scalar();
+    const struct df_audio_kernels *sets[] = { scalar, df_audio_kernels_sse2(), df_audio_kernels_avx2() };
+    std::vector<int16_t> expected_linear(samples), out_linear(samples);
+    std::vector<uint8_t> expected_companded(samples), out_companded(samples);
+    scalar->ulaw_to_linear(companded.data(), expected_linear.data(), samples);
+    scalar->linear_to_ulaw(linear.data(), expected_companded.data(), samples);
+
+    std::cout << "best kernels: " << df_audio_kernels_best()->name << std::endl;
+    for (const struct df_audio_kernels *kernels : sets) {
+        if (kernels == nullptr) {
+            continue;
+        }
+        kernels->ulaw_to_linear(companded.data(), out_linear.data(), samples);
+        kernels->linear_to_ulaw(linear.data(), out_companded.data(), samples);
+        if (out_linear != expected_linear || out_companded != expected_companded) {
+            std::cerr << kernels->name << " kernels disagree with the scalar ones" << std::endl;
+            return 1;
+        }
+
+        double ulaw_in = time_ns([&] { kernels->ulaw_to_linear(companded.data(), out_linear.data(), samples); }, iterations);
+        double alaw_in = time_ns([&] { kernels->alaw_to_linear(companded.data(), out_linear.data(), samples); }, iterations);
+        double ulaw_out = time_ns([&] { kernels->linear_to_ulaw(linear.data(), out_companded.data(), samples); }, iterations);
+        double alaw_out = time_ns([&] { kernels->linear_to_alaw(linear.data(), out_companded.data(), samples); }, iterations);
+        std::cout << kernels->name << ": ulaw->linear " << ulaw_in << " ns, alaw->linear " << alaw_in
+            << " ns, linear->ulaw " << ulaw_out << " ns, linear->alaw " << alaw_out << " ns per " << samples << " samples" << std::endl;
+    }
+
+    static const int rates[][2] = { { 8000, 16000 }, { 16000, 8000 }, { 48000, 16000 }, { 44100, 16000 } };
+    for (const int *rate : rates) {
+        for (const struct df_audio_kernels *kernels : sets) {
+            if (kernels == nullptr) {
+                continue;
+            }
+            df_resampler resampler(rate[0], rate[1], kernels);
+            std::vector<int16_t> out;
+            double per_packet = time_ns([&] { out.clear(); resampler.process(linear.data(), samples, out); }, iterations / 10);
+            std::cout << "resample " << rate[0] << "->" << rate[1] << " (" << kernels->name << "): " << per_packet << " ns per " << samples << " samples" << std::endl;
+        }
+    }
+
+    return 0;
+}
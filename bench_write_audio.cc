@@ -0,0 +1,70 @@
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/impl/codegen/proto_utils.h>
+
+#include <google/cloud/dialogflow/v2beta1/session.grpc.pb.h>
+
+#include "libdfegrpc_internal.h"
+
+using google::cloud::dialogflow::v2beta1::StreamingDetectIntentRequest;
+
+/* compare building a request message per audio packet with encoding the packet straight into a byte buffer.
+   usage: bench_write_audio [packets] [packet_size] */
+
+static size_t message_path(const char *samples, size_t length)
+{
+    std::unique_ptr<StreamingDetectIntentRequest> request(new StreamingDetectIntentRequest());
+    request->set_input_audio(samples, length);
+
+    grpc::ByteBuffer buffer;
+    bool own_buffer;
+    grpc::SerializationTraits<StreamingDetectIntentRequest>::Serialize(*request, &buffer, &own_buffer);
+    return buffer.Length();
+}
+
+static size_t raw_path(const char *samples, size_t length)
+{
+    grpc::ByteBuffer buffer = df_encode_audio_packet(samples, length);
+    return buffer.Length();
+}
+
+template<typename F> static double run(const char *name, F path, const std::string& samples, int packets)
+{
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < packets; i++) {
+        total += path(samples.data(), samples.size());
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    double per_packet = elapsed.count() / packets;
+
+    std::cout << name << ": " << per_packet << " ns/packet (" << total << " bytes)" << std::endl;
+    return per_packet;
+}
+
+int main(int argc, char **argv)
+{
+    int packets = argc > 1 ? atoi(argv[1]) : 1000000;
+    size_t packet_size = argc > 2 ? (size_t) atoi(argv[2]) : 160;
+    std::string samples(packet_size, '\x7f');
+
+    /* the two encodings must agree byte for byte */
+    grpc::ByteBuffer raw = df_encode_audio_packet(samples.data(), samples.size());
+    StreamingDetectIntentRequest parsed;
+    if (!grpc::SerializationTraits<StreamingDetectIntentRequest>::Deserialize(&raw, &parsed).ok() || parsed.input_audio() != samples) {
+        std::cerr << "raw packet does not decode to the original audio" << std::endl;
+        return 1;
+    }
+
+    run("warmup", message_path, samples, packets / 10);
+    double message = run("request message", message_path, samples, packets);
+    double direct = run("raw byte buffer", raw_path, samples, packets);
+    std::cout << "speedup: " << message / direct << "x" << std::endl;
+
+    return 0;
+}
@@ -2,8 +2,13 @@
 #include "gtest/gtest.h"
 #include "mock_stream.h"
 
+#include <cmath>
+#include <poll.h>
+
 #include "libdfegrpc_internal.h"
 
+#include <grpcpp/create_channel.h>
+#include <grpcpp/security/credentials.h>
 #include <google/cloud/dialogflow/v2beta1/session_mock.grpc.pb.h>
 
 using google::cloud::dialogflow::v2beta1::MockSessionsStub;
@@ -29,16 +34,23 @@ using ::testing::Return;
 using ::testing::DoAll;
 using ::testing::SetArgPointee;
 
+/* a session calling the mock. it gets a channel of its own so ensure_connected keeps the stub rather than
+   connecting for real; nothing is ever sent on the channel */
+static struct dialogflow_session *create_mock_session(std::shared_ptr<Sessions::StubInterface> stub)
+{
+    struct dialogflow_session *session = df_create_session(nullptr);
+    session->session = stub;
+    session->channel = grpc::CreateChannel("localhost:1", grpc::InsecureChannelCredentials());
+    return session;
+}
+
 TEST(df_recognize_event, HandlesGoodInput) {
-    struct dialogflow_session session;
-    MockSessionsStub *stub = new MockSessionsStub();
+    std::shared_ptr<MockSessionsStub> stub = std::make_shared<MockSessionsStub>();
+    struct dialogflow_session *session = create_mock_session(stub);
     DetectIntentResponse response;
 
     response.set_response_id("12345");
     response.mutable_query_result()->set_query_text("hello");
-    
-    session.state = DF_STATE_READY;
-    session.session = std::shared_ptr<google::cloud::dialogflow::v2beta1::Sessions::Sessions::StubInterface>(stub);
 
     EXPECT_CALL(*stub, DetectIntent(_, 
         Property(&DetectIntentRequest::query_input, 
@@ -46,34 +58,32 @@ TEST(df_recognize_event, HandlesGoodInput) {
                 Property(&EventInput::name, "hello"))), _))
     .WillOnce(DoAll(SetArgPointee<2>(response), Return(Status::OK)));
 
-    int ret = df_recognize_event(&session, "hello", NULL);
+    int ret = df_recognize_event(session, "hello", NULL, 0);
 
     EXPECT_EQ(ret, 0);
-    EXPECT_EQ(session.results.size(), 8);
+    EXPECT_EQ(df_get_result_count(session), 9);
 
     bool foundQueryText = false;
 
-    for (size_t i = 0; i < session.results.size(); i++) {
-        if (session.results[i]->slot == "query_text") {
-            EXPECT_EQ(session.results[i]->value, "hello");
+    for (int i = 0; i < df_get_result_count(session); i++) {
+        if (!strcmp(df_get_result(session, i)->slot, "query_text")) {
+            EXPECT_STREQ(df_get_result(session, i)->value, "hello");
             foundQueryText = true;
         }
     }
 
     EXPECT_TRUE(foundQueryText);
+    df_close_session(session);
 }
 
 TEST(df_recognize_event, HandlesLanguageChange) {
-    struct dialogflow_session session;
-    std::shared_ptr<MockSessionsStub> stub;
+    std::shared_ptr<MockSessionsStub> stub = std::make_shared<MockSessionsStub>();
+    struct dialogflow_session *session = create_mock_session(stub);
     DetectIntentResponse response;
 
     response.set_response_id("12345");
     response.mutable_query_result()->set_query_text("hello");
     response.mutable_query_result()->set_language_code("es-MX");
-    
-    session.state = DF_STATE_READY;
-    session.session = std::shared_ptr<google::cloud::dialogflow::v2beta1::Sessions::Sessions::StubInterface>(stub);
 
     EXPECT_CALL(*stub, 
         DetectIntent(_, 
@@ -89,20 +99,669 @@ TEST(df_recognize_event, HandlesLanguageChange) {
     )
     .WillOnce(DoAll(SetArgPointee<2>(response), Return(Status::OK)));
 
-    int ret = df_recognize_event(&session, "hello", "es-MX");
+    int ret = df_recognize_event(session, "hello", "es-MX", 0);
 
     EXPECT_EQ(ret, 0);
 
     bool foundLanguage = false;
 
-    for (size_t i = 0; i < session.results.size(); i++) {
-        if (session.results[i]->slot == "language_code") {
-            EXPECT_EQ(session.results[i]->value, "es-MX");
+    for (int i = 0; i < df_get_result_count(session); i++) {
+        if (!strcmp(df_get_result(session, i)->slot, "language_code")) {
+            EXPECT_STREQ(df_get_result(session, i)->value, "es-MX");
             foundLanguage = true;
         }
     }
 
     EXPECT_TRUE(foundLanguage);
+    df_close_session(session);
+}
+
+TEST(df_recognize_event, FlattensResultsWhenRead) {
+    std::shared_ptr<MockSessionsStub> stub = std::make_shared<MockSessionsStub>();
+    struct dialogflow_session *session = create_mock_session(stub);
+    DetectIntentResponse response;
+
+    response.set_response_id("12345");
+    response.mutable_query_result()->mutable_intent()->set_display_name("greeting");
+    (*response.mutable_query_result()->mutable_parameters()->mutable_fields())["color"].set_string_value("red");
+
+    EXPECT_CALL(*stub, DetectIntent(_, _, _)).WillOnce(DoAll(SetArgPointee<2>(response), Return(Status::OK)));
+
+    ASSERT_EQ(df_recognize_event(session, "hello", NULL, 0), 0);
+    EXPECT_EQ(session->results.size(), 0);
+
+    /* the intent is in the first part, the parameters wait until they're asked for */
+    struct dialogflow_result *intent = df_get_result_by_name(session, "intent_display_name");
+    ASSERT_NE(intent, nullptr);
+    EXPECT_STREQ(intent->value, "greeting");
+    EXPECT_EQ(session->results.size(), 8);
+
+    struct dialogflow_result *color = df_get_result_by_name(session, "color");
+    ASSERT_NE(color, nullptr);
+    EXPECT_STREQ(color->value, "red");
+    EXPECT_EQ(df_get_result_count(session), 10);
+    EXPECT_EQ(df_get_result_by_name(session, "intent_display_name"), intent);
+    EXPECT_STREQ(intent->value, "greeting");
+    df_close_session(session);
+}
+
+TEST(df_recognize_event, KeepsFinalResponse) {
+    std::shared_ptr<MockSessionsStub> stub = std::make_shared<MockSessionsStub>();
+    struct dialogflow_session *session = create_mock_session(stub);
+    DetectIntentResponse response;
+    const char *data;
+    size_t length;
+
+    response.set_response_id("12345");
+    response.mutable_query_result()->set_query_text("hello");
+
+    EXPECT_EQ(df_get_final_response(session, &data, &length), -1);
+
+    EXPECT_CALL(*stub, DetectIntent(_, _, _)).WillOnce(DoAll(SetArgPointee<2>(response), Return(Status::OK)));
+    ASSERT_EQ(df_recognize_event(session, "hello", NULL, 0), 0);
+
+    ASSERT_EQ(df_get_final_response(session, &data, &length), 0);
+    DetectIntentResponse parsed;
+    ASSERT_TRUE(parsed.ParseFromArray(data, length));
+    EXPECT_EQ(parsed.response_id(), "12345");
+    EXPECT_EQ(parsed.query_result().query_text(), "hello");
+
+    const char *json;
+    ASSERT_EQ(df_get_final_response_json(session, &json, &length), 0);
+    EXPECT_STREQ(json, "{\"responseId\":\"12345\",\"queryResult\":{\"queryText\":\"hello\"}}");
+    EXPECT_EQ(length, strlen(json));
+    df_close_session(session);
+}
+
+TEST(df_audio_kernels, MatchScalar) {
+    const struct df_audio_kernels *scalar = df_audio_kernels_scalar();
+    const struct df_audio_kernels *sets[] = { df_audio_kernels_sse2(), df_audio_kernels_avx2() };
+
+    /* every code and every sample, plus a few left over for the scalar tails */
+    std::vector<uint8_t> codes(256 + 7);
+    std::vector<int16_t> samples(65536 + 7);
+    for (size_t i = 0; i < codes.size(); i++) {
+        codes[i] = (uint8_t) i;
+    }
+    for (size_t i = 0; i < samples.size(); i++) {
+        samples[i] = (int16_t) (i - 32768);
+    }
+
+    std::vector<int16_t> expected_linear(codes.size()), linear(codes.size());
+    std::vector<uint8_t> expected_codes(samples.size()), out_codes(samples.size());
+    for (const struct df_audio_kernels *kernels : sets) {
+        if (kernels == nullptr) {
+            continue;
+        }
+        scalar->ulaw_to_linear(codes.data(), expected_linear.data(), codes.size());
+        kernels->ulaw_to_linear(codes.data(), linear.data(), codes.size());
+        EXPECT_EQ(linear, expected_linear) << kernels->name;
+        scalar->alaw_to_linear(codes.data(), expected_linear.data(), codes.size());
+        kernels->alaw_to_linear(codes.data(), linear.data(), codes.size());
+        EXPECT_EQ(linear, expected_linear) << kernels->name;
+        scalar->linear_to_ulaw(samples.data(), expected_codes.data(), samples.size());
+        kernels->linear_to_ulaw(samples.data(), out_codes.data(), samples.size());
+        EXPECT_EQ(out_codes, expected_codes) << kernels->name;
+        scalar->linear_to_alaw(samples.data(), expected_codes.data(), samples.size());
+        kernels->linear_to_alaw(samples.data(), out_codes.data(), samples.size());
+        EXPECT_EQ(out_codes, expected_codes) << kernels->name;
+    }
+}
+
+TEST(df_resampler, KeepsRateAndLevel) {
+    df_resampler resampler(8000, 16000, df_audio_kernels_best());
+    std::vector<int16_t> in(160, 1000);
+    std::vector<int16_t> out;
+
+    for (int i = 0; i < 50; i++) {
+        resampler.process(in.data(), in.size(), out);
+    }
+
+    EXPECT_EQ(out.size(), 16000);
+    EXPECT_NEAR(out.back(), 1000, 2);
+}
+
+TEST(df_audio_converter, CarriesSplitSamples) {
+    df_audio_converter converter(DF_SOURCE_AUDIO_SLIN, 8000, DF_AUDIO_ENCODING_LINEAR_16, 8000);
+    const char samples[] = { 1, 2, 3, 4, 5, 6 };
+
+    EXPECT_EQ(converter.convert(samples, 3), std::string(samples, 2));
+    EXPECT_EQ(converter.convert(samples + 3, 3), std::string(samples + 2, 4));
+}
+
+TEST(df_voice_gate, PassesSpeechWithPreRoll) {
+    df_voice_gate gate(DF_SOURCE_AUDIO_SLIN, 8000, -40, 100, 200);
+    std::vector<int16_t> silence(8000, 0);
+    std::vector<int16_t> tone(8000);
+    for (size_t i = 0; i < tone.size(); i++) {
+        tone[i] = (int16_t) (8000 * sin(2 * M_PI * 300 * i / 8000));
+    }
+
+    size_t sent = gate.process((const char *) silence.data(), silence.size() * 2).size();
+    EXPECT_EQ(sent, 0);
+    EXPECT_FALSE(gate.is_open());
+
+    sent = gate.process((const char *) tone.data(), tone.size() * 2).size();
+    EXPECT_TRUE(gate.is_open());
+    /* the whole tone plus the pre-roll ahead of it */
+    EXPECT_EQ(sent, (8000 + 800 - 30 * 8) * 2);
+
+    sent = gate.process((const char *) silence.data(), silence.size() * 2).size();
+    EXPECT_FALSE(gate.is_open());
+    EXPECT_EQ(sent, 200 * 8 * 2);
+    EXPECT_NEAR(gate.suppressed_seconds(), 2.0 - 0.1 + 0.03 - 0.2 - 0.1, 0.02);
+}
+
+TEST(df_endpointer, EndsAfterHangover) {
+    df_endpointer endpointer(DF_SOURCE_AUDIO_SLIN, 8000, -40, 300, 0);
+    std::vector<int16_t> silence(80, 0);
+    std::vector<int16_t> tone(80);
+    for (size_t i = 0; i < tone.size(); i++) {
+        tone[i] = (int16_t) (8000 * sin(2 * M_PI * 400 * i / 8000));
+    }
+
+    /* silence alone never ends anything */
+    for (int i = 0; i < 100; i++) {
+        EXPECT_FALSE(endpointer.process((const char *) silence.data(), silence.size() * 2, 0));
+    }
+    for (int i = 0; i < 50; i++) {
+        EXPECT_FALSE(endpointer.process((const char *) tone.data(), tone.size() * 2, 0));
+        EXPECT_TRUE(endpointer.heard_speech());
+    }
+    for (int i = 0; i < 29; i++) {
+        EXPECT_FALSE(endpointer.process((const char *) silence.data(), silence.size() * 2, 0));
+    }
+    EXPECT_TRUE(endpointer.process((const char *) silence.data(), silence.size() * 2, 0));
+}
+
+TEST(df_stream_call, BoundsPreRoll) {
+    struct dialogflow_session session;
+    df_stream_call unbounded(&session, nullptr);
+    EXPECT_TRUE(unbounded.reserve_pre_roll(1000000));
+
+    df_stream_call call(&session, nullptr);
+    call.set_pre_roll(480);
+    EXPECT_TRUE(call.reserve_pre_roll(160));
+    EXPECT_TRUE(call.reserve_pre_roll(320));
+    EXPECT_FALSE(call.reserve_pre_roll(1));
+}
+
+/* an async stream that keeps the tags it's handed, so the test can play the completion queue */
+class fake_async_stream : public grpc::ClientAsyncReaderWriterInterface<StreamingDetectIntentRequest, StreamingDetectIntentResponse>
+{
+    public:
+    fake_async_stream() : start_tag(nullptr), write_tag(nullptr), writes_done_tag(nullptr)
+    {
+    }
+    void StartCall(void *tag) override { start_tag = tag; }
+    void ReadInitialMetadata(void *tag) override {}
+    void Finish(Status *status, void *tag) override {}
+    void Write(const StreamingDetectIntentRequest& request, void *tag) override
+    {
+        written.push_back(request.input_audio().size());
+        write_tag = tag;
+    }
+    void Write(const StreamingDetectIntentRequest& request, grpc::WriteOptions options, void *tag) override { Write(request, tag); }
+    void Read(StreamingDetectIntentResponse *response, void *tag) override {}
+    void WritesDone(void *tag) override { writes_done_tag = tag; }
+
+    void *start_tag;
+    void *write_tag;
+    void *writes_done_tag;
+    std::vector<size_t> written;
+};
+
+static void complete_op(void *tag)
+{
+    ASSERT_NE(tag, nullptr);
+    static_cast<df_async_op *>(tag)->complete(true);
+}
+
+TEST(df_stream_call, CoalescesUpToPacketSize) {
+    std::shared_ptr<MockSessionsStub> stub = std::make_shared<MockSessionsStub>();
+    fake_async_stream *stream = new fake_async_stream();
+    EXPECT_CALL(*stub, PrepareAsyncStreamingDetectIntentRaw(_, _)).WillOnce(Return(stream));
+    struct dialogflow_session *session = df_create_session(nullptr);
+    std::shared_ptr<df_stream_call> call = std::make_shared<df_stream_call>(session, nullptr);
+    char audio[100] = {};
+
+    call->set_turn_memory(std::make_shared<df_turn_memory>());
+    call->set_coalescing(250, 0);
+    call->start(stub.get(), nullptr, nullptr);
+    complete_op(stream->start_tag);
+
+    EXPECT_TRUE(call->write_audio(audio, 100));
+    EXPECT_TRUE(call->write_audio(audio, 100));
+    EXPECT_TRUE(stream->written.empty());
+    EXPECT_TRUE(call->write_audio(audio, 100));
+    EXPECT_EQ(stream->written, std::vector<size_t>({300}));
+    complete_op(stream->write_tag);
+
+    /* the remainder goes out on its own, ahead of WritesDone */
+    EXPECT_TRUE(call->write_audio(audio, 60));
+    call->writes_done();
+    EXPECT_EQ(stream->written, std::vector<size_t>({300, 60}));
+    EXPECT_EQ(stream->writes_done_tag, nullptr);
+    complete_op(stream->write_tag);
+    EXPECT_NE(stream->writes_done_tag, nullptr);
+    EXPECT_FALSE(call->write_audio(audio, 100));
+
+    complete_op(stream->writes_done_tag);
+    call.reset();
+    df_close_session(session);
+}
+
+TEST(df_audio_ring, WrapsAround) {
+    df_audio_ring ring(8);
+    std::string out;
+
+    EXPECT_TRUE(ring.write("abcdef", 6));
+    EXPECT_EQ(ring.read(out, 4), 4);
+    EXPECT_EQ(out, "abcd");
+
+    /* runs past the end of the buffer and continues at the start */
+    EXPECT_TRUE(ring.write("ghijk", 5));
+    EXPECT_EQ(ring.readable(), 7);
+    char raw[8];
+    EXPECT_EQ(ring.read(raw, sizeof(raw)), 7);
+    EXPECT_EQ(std::string(raw, 7), "efghijk");
+    EXPECT_EQ(ring.readable(), 0);
+    EXPECT_EQ(ring.high_water.load(), 7);
+}
+
+TEST(df_audio_ring, DropsFramesThatDontFit) {
+    df_audio_ring ring(8);
+    std::string out;
+
+    EXPECT_TRUE(ring.write("abcde", 5));
+    EXPECT_FALSE(ring.write("fghi", 4));
+    EXPECT_EQ(ring.dropped_bytes.load(), 4);
+    EXPECT_TRUE(ring.write("fgh", 3));
+    EXPECT_EQ(ring.readable(), 8);
+    EXPECT_FALSE(ring.write("i", 1));
+    EXPECT_EQ(ring.dropped_bytes.load(), 5);
+
+    EXPECT_EQ(ring.read(out, 100), 8);
+    EXPECT_EQ(out, "abcdefgh");
+    EXPECT_TRUE(ring.write("i", 1));
+}
+
+TEST(df_get_event_fd, ReadableUntilDrained) {
+    struct dialogflow_session *session = df_create_session(nullptr);
+    struct pollfd fd = {};
+    fd.fd = df_get_event_fd(session);
+    fd.events = POLLIN;
+    ASSERT_GE(fd.fd, 0);
+    EXPECT_EQ(poll(&fd, 1, 0), 0);
+
+    struct dialogflow_event event = {};
+    event.type = DF_EVENT_END_OF_UTTERANCE;
+    df_emit_event(session, event);
+    event.type = DF_EVENT_FINISHED;
+    df_emit_event(session, event);
+    EXPECT_EQ(poll(&fd, 1, 0), 1);
+
+    struct dialogflow_event next;
+    ASSERT_EQ(df_get_next_event(session, &next), 1);
+    EXPECT_EQ(next.type, DF_EVENT_END_OF_UTTERANCE);
+    ASSERT_EQ(df_get_next_event(session, &next), 1);
+    EXPECT_EQ(next.type, DF_EVENT_FINISHED);
+    EXPECT_EQ(df_get_next_event(session, &next), 0);
+    EXPECT_EQ(poll(&fd, 1, 0), 0);
+
+    df_close_session(session);
+}
+
+TEST(df_get_event_fd, QueuesStateChanges) {
+    std::shared_ptr<MockSessionsStub> stub = std::make_shared<MockSessionsStub>();
+    fake_async_stream *stream = new fake_async_stream();
+    EXPECT_CALL(*stub, PrepareAsyncStreamingDetectIntentRaw(_, _)).WillOnce(Return(stream));
+    struct dialogflow_session *session = df_create_session(nullptr);
+    std::shared_ptr<df_stream_call> call = std::make_shared<df_stream_call>(session, nullptr);
+    char audio[100] = {};
+    ASSERT_GE(df_get_event_fd(session), 0);
+
+    /* as df_start_recognition leaves it while pre-roll waits for the stream */
+    session->state = DF_STATE_STARTING;
+    std::atomic_store(&session->current_request, call);
+    call->set_turn_memory(std::make_shared<df_turn_memory>());
+    call->start(stub.get(), nullptr, nullptr);
+    complete_op(stream->start_tag);
+    EXPECT_EQ(df_get_state(session), DF_STATE_STARTED);
+
+    EXPECT_TRUE(call->write_audio(audio, 100));
+    ASSERT_NE(stream->write_tag, nullptr);
+    static_cast<df_async_op *>(stream->write_tag)->complete(false);
+    EXPECT_EQ(df_get_state(session), DF_STATE_ERROR);
+
+    struct dialogflow_event next;
+    ASSERT_EQ(df_get_next_event(session, &next), 1);
+    EXPECT_EQ(next.type, DF_EVENT_STATE_CHANGED);
+    EXPECT_EQ(next.state, DF_STATE_STARTED);
+    ASSERT_EQ(df_get_next_event(session, &next), 1);
+    EXPECT_EQ(next.type, DF_EVENT_STATE_CHANGED);
+    EXPECT_EQ(next.state, DF_STATE_ERROR);
+    ASSERT_EQ(df_get_next_event(session, &next), 1);
+    EXPECT_EQ(next.type, DF_EVENT_ERROR);
+    EXPECT_EQ(df_get_next_event(session, &next), 0);
+
+    /* the call was never the session's own, so don't let closing try to stop it */
+    std::atomic_store(&session->current_request, std::shared_ptr<df_stream_call>());
+    session->state = DF_STATE_READY;
+    call.reset();
+    df_close_session(session);
+}
+
+#ifdef HAVE_OPUS
+TEST(df_opus_encoder, EndsStreamOnFinish) {
+    std::unique_ptr<df_opus_encoder> encoder(df_opus_encoder::create(8000, 16000));
+    ASSERT_NE(encoder, nullptr);
+    std::vector<int16_t> samples(250, 1000);
+    std::string out;
+
+    /* one whole 20ms frame and 90 samples over, none of it enough for a page */
+    encoder->encode(samples.data(), samples.size(), out);
+    encoder->finish(out);
+
+    struct ogg_page {
+        uint8_t flags;
+        uint64_t granule_position;
+        size_t packets;
+    };
+    std::vector<ogg_page> pages;
+    for (size_t position = 0; position + 27 <= out.size(); ) {
+        ASSERT_EQ(out.compare(position, 4, "OggS"), 0);
+        ogg_page page = { (uint8_t) out[position + 5], 0, 0 };
+        memcpy(&page.granule_position, &out[position + 6], 8);
+        size_t segments = (uint8_t) out[position + 26];
+        size_t body = 0;
+        for (size_t i = 0; i < segments; i++) {
+            uint8_t lacing = (uint8_t) out[position + 27 + i];
+            body += lacing;
+            page.packets += (lacing < 255);
+        }
+        pages.push_back(page);
+        position += 27 + segments + body;
+    }
+
+    /* the two headers, then both packets on the last page */
+    ASSERT_EQ(pages.size(), 3);
+    EXPECT_EQ(pages[2].flags, 0x04);
+    EXPECT_EQ(pages[2].packets, 2);
+    /* at 48kHz, stopping at the real samples rather than the padding */
+    uint16_t pre_skip;
+    memcpy(&pre_skip, &out[28 + 10], 2);
+    EXPECT_EQ(pages[2].granule_position, pre_skip + 250 * 6);
+
+    /* nothing after the end */
+    std::string after;
+    encoder->encode(samples.data(), samples.size(), after);
+    encoder->finish(after);
+    EXPECT_TRUE(after.empty());
+}
+#endif
+
+TEST(df_parse_wav, FindsSamplesWithinBounds) {
+    /* 8kHz 16 bit mono with a LIST chunk ahead of the format, and a data size running past the end */
+    const char header[] = "RIFF\x00\x00\x00\x00WAVE" "LIST\x03\x00\x00\x00" "abc\x00"
+        "fmt \x10\x00\x00\x00\x01\x00\x01\x00\x40\x1f\x00\x00\x80\x3e\x00\x00\x02\x00\x10\x00" "data\xff\xff\xff\xff";
+    std::string wav(header, sizeof(header) - 1);
+    wav.append(1600, 'x');
+    struct dialogflow_output_audio audio;
+
+    ASSERT_TRUE(df_parse_wav(wav.data(), wav.length(), &audio));
+    EXPECT_EQ(audio.format, 1);
+    EXPECT_EQ(audio.channels, 1);
+    EXPECT_EQ(audio.sample_rate, 8000);
+    EXPECT_EQ(audio.bits_per_sample, 16);
+    EXPECT_EQ(audio.samples_offset, sizeof(header) - 1);
+    EXPECT_EQ(audio.samples_length, 1600);
+
+    for (size_t length = 0; length < sizeof(header) - 1; length++) {
+        EXPECT_FALSE(df_parse_wav(wav.data(), length, &audio)) << length;
+    }
+    EXPECT_FALSE(df_parse_wav("RIFF\x00\x00\x00\x00WAVEdata", 16, &audio));
+}
+
+TEST(df_get_output_audio, TreatsNonWavAsSamples) {
+    struct dialogflow_session *session = df_create_session(nullptr);
+    struct dialogflow_output_audio audio;
+    EXPECT_EQ(df_get_output_audio(session, &audio), -1);
+
+    session->output_audio = std::make_shared<const std::string>("not a wav file");
+    ASSERT_EQ(df_get_output_audio(session, &audio), 0);
+    EXPECT_EQ(audio.length, 14);
+    EXPECT_EQ(audio.format, 0);
+    EXPECT_EQ(audio.samples_offset, 0);
+    EXPECT_EQ(audio.samples_length, 14);
+
+    df_close_session(session);
+}
+
+TEST(df_convert_output_audio, StripsHeaderAndConverts) {
+    const char header[] = "RIFF\x00\x00\x00\x00WAVE"
+        "fmt \x10\x00\x00\x00\x01\x00\x01\x00\x40\x1f\x00\x00\x80\x3e\x00\x00\x02\x00\x10\x00" "data\x04\x00\x00\x00";
+    std::string wav(header, sizeof(header) - 1);
+    wav.append("\x00\x00\xff\x7f", 4);
+    std::string out;
+
+    ASSERT_TRUE(df_convert_output_audio(wav.data(), wav.length(), DF_OUTPUT_AUDIO_SLIN, out));
+    EXPECT_EQ(out, std::string("\x00\x00\xff\x7f", 4));
+    ASSERT_TRUE(df_convert_output_audio(wav.data(), wav.length(), DF_OUTPUT_AUDIO_MULAW, out));
+    EXPECT_EQ(out, "\xff\x80");
+    ASSERT_TRUE(df_convert_output_audio(wav.data(), wav.length(), DF_OUTPUT_AUDIO_ALAW, out));
+    EXPECT_EQ(out, "\xd5\xaa");
+    ASSERT_TRUE(df_convert_output_audio(wav.data(), wav.length(), DF_OUTPUT_AUDIO_AS_SENT, out));
+    EXPECT_EQ(out, wav);
+
+    /* more samples without a header, and a WAV file of float samples */
+    ASSERT_TRUE(df_convert_output_audio("\xff\x7f\x00", 3, DF_OUTPUT_AUDIO_MULAW, out));
+    EXPECT_EQ(out, "\x80");
+    wav[20] = 3;
+    EXPECT_FALSE(df_convert_output_audio(wav.data(), wav.length(), DF_OUTPUT_AUDIO_MULAW, out));
+}
+
+TEST(df_result_table, KeepsValuesWithNuls) {
+    df_result_table results;
+    results.add("slot", "value", 10);
+    results.add("output_audio", std::string("ab\0cd", 5), 20);
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_STREQ(results.get(0)->slot, "slot");
+    EXPECT_STREQ(results.get(0)->value, "value");
+    EXPECT_EQ(results.get(1)->valueLen, 5);
+    EXPECT_EQ(memcmp(results.get(1)->value, "ab\0cd", 5), 0);
+    EXPECT_EQ(results.get(1)->score, 20);
+    EXPECT_EQ(results.get(2), nullptr);
+
+    results.clear();
+    EXPECT_EQ(results.size(), 0);
+}
+
+TEST(df_result_table, FindsByNameAndPrefix) {
+    df_result_table results;
+    results.add("text", "a", 0);
+    for (int i = 1; i <= 11; i++) {
+        results.add("text_" + std::to_string(i), std::to_string(i), 0);
+    }
+    results.add("intent_display_name", "greeting", 0);
+    results.add("text_2", "again", 0);
+
+    EXPECT_EQ(results.find("intent_display_name"), 12);
+    EXPECT_EQ(results.find("text_2"), 2);
+    EXPECT_EQ(results.find("text_"), -1);
+    EXPECT_EQ(results.find("zzz"), -1);
+
+    /* in the order added, not text_10 before text_2 */
+    std::vector<int> found;
+    for (int index = results.find_prefix("text", 0); index >= 0; index = results.find_prefix("text", index + 1)) {
+        found.push_back(index);
+    }
+    ASSERT_EQ(found.size(), 13);
+    for (int i = 0; i < 12; i++) {
+        EXPECT_EQ(found[i], i);
+    }
+    EXPECT_EQ(found[12], 13);
+    EXPECT_EQ(results.find_prefix("intent", 13), -1);
+
+    results.clear();
+    EXPECT_EQ(results.find("text"), -1);
+}
+
+TEST(df_turn_memory, SharesResponses) {
+    std::shared_ptr<df_turn_memory> memory = std::make_shared<df_turn_memory>();
+    StreamingDetectIntentResponse *response = memory->new_response();
+    response->set_output_audio(std::string(100000, 'x'));
+    memory->response_read();
+
+    std::shared_ptr<StreamingDetectIntentResponse> kept(memory, response);
+    memory.reset();
+    EXPECT_EQ(kept->output_audio().size(), 100000);
+
+    memory = std::make_shared<df_turn_memory>();
+    memory->new_response();
+    memory->response_read();
+    memory->new_response();
+    memory->response_read();
+    EXPECT_EQ(memory->responses, 2);
+    EXPECT_EQ(memory->allocations, 1);
+    EXPECT_GT(memory->arena_bytes, 0);
+}
+
+TEST(channel_pool, SharesGroupUntilLastRelease) {
+    df_set_channel_shards(1, 1, 0);
+    std::string key = make_channel_pool_key("localhost:1", "");
+    EXPECT_NE(make_channel_pool_key("localhost:1", "other key"), key);
+    EXPECT_NE(make_channel_pool_key("localhost:1|a", "b"), make_channel_pool_key("localhost:1", "a|b"));
+
+    std::shared_ptr<df_channel_group> first = acquire_channel_group(key, "localhost:1", "");
+    ASSERT_NE(first, nullptr);
+    std::shared_ptr<df_channel_group> second = acquire_channel_group(key, "localhost:1", "");
+    EXPECT_EQ(first, second);
+    EXPECT_EQ(first->references, 2);
+
+    std::weak_ptr<df_channel_group> pooled(first);
+    first.reset();
+    second.reset();
+    release_channel_group(key);
+    EXPECT_FALSE(pooled.expired());
+    release_channel_group(key);
+    EXPECT_TRUE(pooled.expired());
+    df_set_channel_shards(1, 16, 100);
+}
+
+TEST(channel_pool, SpreadsStreamsOverShards) {
+    df_channel_group group;
+    group.references = 1;
+    for (int i = 0; i < 2; i++) {
+        group.shards.push_back(std::make_shared<df_channel_shard>());
+        group.shards[i]->active_streams = 0;
+    }
+
+    /* two streams a shard, and no growing past the two there are */
+    df_set_channel_shards(2, 2, 2);
+    std::shared_ptr<df_channel_shard> home = select_channel_shard(group, "session", false);
+    EXPECT_EQ(group.shards[0]->active_streams + group.shards[1]->active_streams, 0);
+    EXPECT_EQ(select_channel_shard(group, "session", true), home);
+    EXPECT_EQ(select_channel_shard(group, "session", true), home);
+    EXPECT_NE(select_channel_shard(group, "session", true), home);
+    EXPECT_NE(select_channel_shard(group, "session", true), home);
+    EXPECT_EQ(group.shards[0]->active_streams, 2);
+    EXPECT_EQ(group.shards[1]->active_streams, 2);
+
+    /* the other shard is free again */
+    (home == group.shards[0] ? group.shards[1] : group.shards[0])->active_streams = 0;
+    EXPECT_NE(select_channel_shard(group, "session", true), home);
+
+    /* no stream limit goes by the hash alone */
+    df_set_channel_shards(2, 2, 0);
+    EXPECT_EQ(select_channel_shard(group, "session", false), home);
+    df_set_channel_shards(1, 16, 100);
+}
+
+TEST(df_start_recognition, GivesBackShardOnFailedStart) {
+    struct dialogflow_session *session = df_create_session(nullptr);
+    std::shared_ptr<df_channel_group> group = std::make_shared<df_channel_group>();
+    std::shared_ptr<df_channel_shard> shard = std::make_shared<df_channel_shard>();
+
+    shard->channel = grpc::CreateChannel("localhost:1", grpc::InsecureChannelCredentials());
+    shard->active_streams = 0;
+    group->references = 1;
+    group->shards.push_back(shard);
+    session->channel_group = group;
+    session->channel_shard = shard;
+    session->channel = shard->channel;
+
+    /* nothing converts to AMR, so the start fails after connecting */
+    ASSERT_EQ(df_set_input_audio_format(session, DF_AUDIO_ENCODING_AMR, 8000), 0);
+    ASSERT_EQ(df_set_source_audio_format(session, DF_SOURCE_AUDIO_MULAW, 8000), 0);
+    EXPECT_EQ(df_start_recognition(session, "en-US", 0, nullptr, 0), -1);
+    EXPECT_EQ(shard->active_streams, 0);
+    EXPECT_EQ(session->stream_shard, nullptr);
+    EXPECT_EQ(df_get_state(session), DF_STATE_READY);
+
+    df_close_session(session);
+}
+
+struct async_close_log {
+    std::mutex lock;
+    std::condition_variable cond;
+    bool returned;
+    bool destroyed;
+    bool destroyed_after_return;
+    std::thread::id destroy_thread;
+};
+
+static void log_async_close(void *user_data, const char *event, size_t log_data_size, const struct dialogflow_log_data *data)
+{
+    if (user_data == nullptr || strcmp(event, "destroy")) {
+        return;
+    }
+    struct async_close_log *log = (struct async_close_log *) user_data;
+    std::unique_lock<std::mutex> lock(log->lock);
+    /* holds the reaper here, so the session is still around while the test uses it */
+    log->cond.wait_for(lock, std::chrono::seconds(10), [log] { return log->returned; });
+    log->destroyed_after_return = log->returned;
+    log->destroy_thread = std::this_thread::get_id();
+    log->destroyed = true;
+    log->cond.notify_all();
+}
+
+TEST(df_close_session_async, ClosesOnReaperThread) {
+    struct async_close_log log;
+    log.returned = false;
+    log.destroyed = false;
+    log.destroyed_after_return = false;
+    df_init(nullptr, log_async_close);
+
+    struct dialogflow_session *session = df_create_session(&log);
+    EXPECT_EQ(df_close_session_async(session), 0);
+
+    char audio[160] = {};
+    EXPECT_EQ(df_start_recognition(session, "en-US", 0, nullptr, 0), -1);
+    EXPECT_EQ(df_recognize_event_async(session, "WELCOME", "en-US", 0), -1);
+    EXPECT_EQ(df_write_audio(session, audio, sizeof(audio)), DF_STATE_FINISHED);
+
+    std::unique_lock<std::mutex> lock(log.lock);
+    log.returned = true;
+    log.cond.notify_all();
+    EXPECT_TRUE(log.cond.wait_for(lock, std::chrono::seconds(10), [&log] { return log.destroyed; }));
+    EXPECT_TRUE(log.destroyed_after_return);
+    EXPECT_NE(log.destroy_thread, std::this_thread::get_id());
+}
+
+TEST(df_start_recognition, RefusesOpusForOtherEncodings) {
+    struct dialogflow_session *session = create_mock_session(std::make_shared<MockSessionsStub>());
+
+    /* set directly, df_set_opus_compression refuses without opus built in */
+    session->opus_bitrate = 16000;
+    ASSERT_EQ(df_set_input_audio_format(session, DF_AUDIO_ENCODING_FLAC, 8000), 0);
+    EXPECT_EQ(df_start_recognition(session, "en-US", 0, nullptr, 0), -1);
+    EXPECT_EQ(df_get_state(session), DF_STATE_READY);
+    struct dialogflow_result *error = df_get_result_by_name(session, "error");
+    ASSERT_NE(error, nullptr);
+    EXPECT_STREQ(error->value, "Unsupported audio conversion");
+
+    df_close_session(session);
 }
 
 #if 0
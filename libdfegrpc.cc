@@ -1,13 +1,19 @@
 #include <iostream>
+#include <algorithm>
 #include <vector>
 #include <string>
 #include <cstdarg>
 #include <cstring>
 #include <thread>
 #include <mutex>
+#include <map>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
 
 #include "libdfegrpc.h"
 #include "libdfegrpc_internal.h"
@@ -18,6 +24,9 @@
 #include <grpcpp/client_context.h>
 #include <grpcpp/create_channel.h>
 #include <grpcpp/security/credentials.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/util/json_util.h>
 
 #include <google/cloud/dialogflow/v2beta1/session.grpc.pb.h>
 
@@ -36,6 +45,7 @@ using google::cloud::dialogflow::v2beta1::StreamingDetectIntentRequest;
 using google::cloud::dialogflow::v2beta1::DetectIntentResponse;
 using google::cloud::dialogflow::v2beta1::DetectIntentRequest;
 using google::cloud::dialogflow::v2beta1::QueryResult;
+using google::cloud::dialogflow::v2beta1::StreamingRecognitionResult;
 
 using google::cloud::texttospeech::v1beta1::TextToSpeech;
 using google::cloud::texttospeech::v1beta1::SynthesizeSpeechRequest;
@@ -51,6 +61,22 @@ using google::cloud::texttospeech::v1beta1::SynthesizeSpeechResponse;
 
 #define ARRAY_LEN(a) (size_t) (sizeof(a) / sizeof(0[a]))
 
+/* the most audio sent in one request when the sender is catching up */
+#define DF_MAX_AUDIO_PACKET 16384
+
+/* a batch item is read and written this much at a time, with at most this many packets waiting on flow control */
+#define DF_BATCH_CHUNK_BYTES 3200
+#define DF_BATCH_MAX_PENDING 8
+/* how long a batch item may go without the stream taking any audio before it's given up on */
+#define DF_BATCH_WRITE_TIMEOUT_MS 30000
+
+/* the smallest block of result strings, enough for most recognitions */
+#define DF_RESULT_BLOCK_BYTES 1024
+/* results are flattened in parts: the query fields, fulfillment messages, parameters and the rest */
+#define DF_RESULT_PARTS 4
+
+#define DF_STREAMING_DETECT_INTENT_METHOD "/google.cloud.dialogflow.v2beta1.Sessions/StreamingDetectIntent"
+
 static void noop_log(enum dialogflow_log_level level, const char *file, int line, const char *function, const char *fmt, va_list args)
 {
 }
@@ -61,6 +87,7 @@ static void noop_call_log(void *user_data, const char *event, size_t log_data_si
 
 static DF_LOG_FUNC parent_df_log = noop_log;
 static DF_CALL_LOG_FUNC df_log_call = noop_call_log;
+static DF_EVENT_FUNC global_event_function = nullptr;
 
 static void df_log(enum dialogflow_log_level level, const char *file, int line, const char *function, const char *fmt, ...)
 {
@@ -85,6 +112,181 @@ static timeval tvnow(void)
 	return t;
 }
 
+static int64_t tvdiff_ms(const timeval& end, const timeval& start)
+{
+    return (int64_t) (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+}
+
+/* channel groups are shared between all sessions using the same endpoint and credentials
+   so each call doesn't pay for its own connection and TLS handshake */
+static std::mutex channel_pool_lock;
+static std::map<std::string, std::shared_ptr<df_channel_group>> channel_pool;
+static size_t channel_shard_count = 1;
+static size_t channel_shard_max = 16;
+static size_t channel_shard_max_streams = 100;
+
+/* a small fixed set of threads drive every streaming call through their completion queues,
+   so the thread count doesn't grow with the number of calls */
+static std::mutex completion_lock;
+static std::vector<std::unique_ptr<grpc::CompletionQueue>> completion_queues;
+static std::vector<std::thread> completion_threads;
+static size_t completion_thread_count = 0;
+static std::atomic<size_t> next_completion_queue(0);
+
+/* event callbacks run on the completion threads, where waiting on a call would wait on the very op being handled */
+static thread_local bool on_completion_thread = false;
+
+static bool refuse_on_completion_thread(struct dialogflow_session *session, const char *what)
+{
+    if (!on_completion_thread) {
+        return false;
+    }
+    df_log(LOG_ERROR, "Session %s can't %s from an event callback, it would wait on itself\n", session->session_id.c_str(), what);
+    return true;
+}
+
+static void df_completion_exec(grpc::CompletionQueue *cq)
+{
+    void *tag;
+    bool ok;
+
+    on_completion_thread = true;
+    while (cq->Next(&tag, &ok)) {
+        static_cast<df_async_op *>(tag)->complete(ok);
+    }
+}
+
+static void start_completion_threads_locked(void)
+{
+    size_t count = completion_thread_count;
+    if (count == 0) {
+        count = std::min<size_t>(std::max<unsigned>(std::thread::hardware_concurrency(), 1), 4);
+    }
+    for (size_t i = 0; i < count; i++) {
+        completion_queues.push_back(std::unique_ptr<grpc::CompletionQueue>(new grpc::CompletionQueue()));
+        completion_threads.push_back(std::thread(df_completion_exec, completion_queues.back().get()));
+    }
+    df_log(LOG_DEBUG, "Started %d completion queue threads\n", (int) count);
+}
+
+static grpc::CompletionQueue *get_completion_queue(void)
+{
+    std::lock_guard<std::mutex> lock(completion_lock);
+    if (completion_queues.empty()) {
+        start_completion_threads_locked();
+    }
+    return completion_queues[next_completion_queue++ % completion_queues.size()].get();
+}
+
+/* sessions handed to df_close_session_async. the reaper thread closes each one once its calls have
+   completed, so hangup doesn't wait on the network */
+struct df_reaper_entry {
+    struct dialogflow_session *session;
+    std::chrono::steady_clock::time_point deadline;
+    bool cancelled;
+};
+
+static std::mutex reaper_lock;
+static std::condition_variable reaper_cond;
+static std::deque<df_reaper_entry> reaper_sessions;
+static std::thread reaper_thread;
+static bool reaper_running = false;
+static bool reaper_stopping = false;
+static int reaper_timeout_ms = 10000;
+
+static bool is_session_idle(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (session->current_request != nullptr && !session->current_request->is_finished()) {
+        return false;
+    }
+    return session->current_event_call == nullptr || session->current_event_call->is_finished();
+}
+
+static void cancel_session_calls(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (session->current_request != nullptr) {
+        session->current_request->cancel();
+    }
+    if (session->current_event_call != nullptr) {
+        session->current_event_call->cancel();
+    }
+}
+
+static void df_reaper_exec(void)
+{
+    std::unique_lock<std::mutex> lock(reaper_lock);
+
+    while (!reaper_stopping || !reaper_sessions.empty()) {
+        std::vector<struct dialogflow_session *> idle;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        for (auto entry = reaper_sessions.begin(); entry != reaper_sessions.end(); ) {
+            if (is_session_idle(entry->session)) {
+                idle.push_back(entry->session);
+                entry = reaper_sessions.erase(entry);
+                continue;
+            }
+            if (!entry->cancelled && (reaper_stopping || now >= entry->deadline)) {
+                if (reaper_stopping) {
+                    df_log(LOG_DEBUG, "Session %s still finishing at shutdown, cancelling it\n", entry->session->session_id.c_str());
+                } else {
+                    df_log(LOG_WARNING, "Session %s took too long to finish after closing, cancelling it\n", entry->session->session_id.c_str());
+                }
+                cancel_session_calls(entry->session);
+                entry->cancelled = true;
+            }
+            ++entry;
+        }
+
+        if (idle.empty()) {
+            reaper_cond.wait_for(lock, std::chrono::milliseconds(500));
+            continue;
+        }
+
+        lock.unlock();
+        for (struct dialogflow_session *session : idle) {
+            /* every call has completed so this doesn't block */
+            df_close_session(session);
+        }
+        lock.lock();
+    }
+}
+
+/* called when a call completes so the reaper can look for sessions that are done */
+static void wake_reaper(void)
+{
+    std::lock_guard<std::mutex> lock(reaper_lock);
+    if (reaper_running) {
+        reaper_cond.notify_one();
+    }
+}
+
+static void stop_reaper(void)
+{
+    std::unique_lock<std::mutex> lock(reaper_lock);
+    if (!reaper_running) {
+        return;
+    }
+    reaper_stopping = true;
+    reaper_cond.notify_one();
+    lock.unlock();
+
+    reaper_thread.join();
+
+    lock.lock();
+    reaper_running = false;
+    reaper_stopping = false;
+}
+
+int df_set_completion_threads(size_t thread_count)
+{
+    std::lock_guard<std::mutex> lock(completion_lock);
+    completion_thread_count = thread_count;
+    return 0;
+}
+
 int df_init(DF_LOG_FUNC log_function, DF_CALL_LOG_FUNC call_log_function)
 {
     grpc_init();
@@ -96,16 +298,39 @@ int df_init(DF_LOG_FUNC log_function, DF_CALL_LOG_FUNC call_log_function)
     }
     gpr_set_log_function(wrapper_grpc_log);
     gpr_set_log_verbosity(GPR_LOG_SEVERITY_DEBUG);
+
+    std::lock_guard<std::mutex> lock(completion_lock);
+    if (completion_queues.empty()) {
+        start_completion_threads_locked();
+    }
     return 0;
 }
 
 int df_shutdown(void)
 {
+    /* sessions still closing need the completion queues to finish */
+    stop_reaper();
+
+    std::unique_lock<std::mutex> lock(channel_pool_lock);
+    channel_pool.clear();
+    lock.unlock();
+
+    std::unique_lock<std::mutex> completion(completion_lock);
+    for (auto& cq : completion_queues) {
+        cq->Shutdown();
+    }
+    for (auto& thread : completion_threads) {
+        thread.join();
+    }
+    completion_threads.clear();
+    completion_queues.clear();
+    completion.unlock();
+
     grpc_shutdown();
     return 0;
 }
 
-static std::shared_ptr<Channel> create_grpc_channel(const std::string& endpoint, const std::string& auth_key)
+static std::shared_ptr<Channel> create_grpc_channel(const std::string& endpoint, const std::string& auth_key, size_t shard)
 {
     std::shared_ptr<grpc::ChannelCredentials> creds;
 
@@ -121,9 +346,115 @@ static std::shared_ptr<Channel> create_grpc_channel(const std::string& endpoint,
         creds = grpc::GoogleDefaultCredentials();
     }
 
-    df_log(LOG_INFO, "Creating DF session to %s\n", endpoint.c_str());
+    df_log(LOG_INFO, "Creating DF session to %s (shard %d)\n", endpoint.c_str(), (int) shard);
+
+    /* grpc shares subchannels between channels with identical arguments, so give
+       each shard its own subchannel pool to get a connection of its own */
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    args.SetInt("dfegrpc.channel_shard", int(shard));
+
+    return grpc::CreateCustomChannel(endpoint, creds, args);
+}
+
+/* the whole key rather than a hash of it, so sessions with different credentials can never share channels.
+   endpoints come in as C strings, so the nul can't be part of one. it holds the key, so it's never logged */
+std::string make_channel_pool_key(const std::string& endpoint, const std::string& auth_key)
+{
+    std::string key(endpoint);
+    key += '\0';
+    key += auth_key;
+    return key;
+}
+
+/* must be called with the channel_pool_lock held */
+static std::shared_ptr<df_channel_shard> add_channel_shard(df_channel_group& group)
+{
+    std::shared_ptr<Channel> channel = create_grpc_channel(group.endpoint, group.auth_key, group.shards.size());
+    if (channel == nullptr) {
+        return nullptr;
+    }
+    std::shared_ptr<df_channel_shard> shard = std::make_shared<df_channel_shard>();
+    shard->channel = channel;
+    shard->active_streams = 0;
+    group.shards.push_back(shard);
+    return shard;
+}
+
+std::shared_ptr<df_channel_group> acquire_channel_group(const std::string& key, const std::string& endpoint, const std::string& auth_key)
+{
+    std::lock_guard<std::mutex> lock(channel_pool_lock);
+    auto iterator = channel_pool.find(key);
+    if (iterator != channel_pool.end()) {
+        iterator->second->references++;
+        df_log(LOG_DEBUG, "Reusing channel group to %s (%d references)\n", endpoint.c_str(), iterator->second->references);
+        return iterator->second;
+    }
+
+    std::shared_ptr<df_channel_group> group = std::make_shared<df_channel_group>();
+    group->endpoint = endpoint;
+    group->auth_key = auth_key;
+    group->references = 1;
+    for (size_t i = 0; i < std::max<size_t>(channel_shard_count, 1); i++) {
+        if (add_channel_shard(*group) == nullptr) {
+            break;
+        }
+    }
+    if (group->shards.empty()) {
+        return nullptr;
+    }
+    channel_pool[key] = group;
+    return group;
+}
+
+void release_channel_group(const std::string& key)
+{
+    std::lock_guard<std::mutex> lock(channel_pool_lock);
+    auto iterator = channel_pool.find(key);
+    if (iterator != channel_pool.end() && --iterator->second->references <= 0) {
+        df_log(LOG_DEBUG, "Releasing last reference to channel group to %s\n", iterator->second->endpoint.c_str());
+        channel_pool.erase(iterator);
+    }
+}
+
+/* sessions land on a shard by the hash of their id; if that shard already carries as many
+   streams as a connection should, spread to the least loaded shard, growing the group if needed.
+   the stream is counted against the shard here so concurrent starts see each other */
+std::shared_ptr<df_channel_shard> select_channel_shard(df_channel_group& group, const std::string& hash_key, bool add_stream)
+{
+    std::lock_guard<std::mutex> lock(channel_pool_lock);
+    size_t index = std::hash<std::string>()(hash_key) % group.shards.size();
+
+    if (channel_shard_max_streams > 0 && size_t(group.shards[index]->active_streams) >= channel_shard_max_streams) {
+        size_t least = index;
+        for (size_t i = 0; i < group.shards.size(); i++) {
+            if (group.shards[i]->active_streams < group.shards[least]->active_streams) {
+                least = i;
+            }
+        }
+        if (size_t(group.shards[least]->active_streams) >= channel_shard_max_streams && group.shards.size() < channel_shard_max) {
+            df_log(LOG_INFO, "All %d channels to %s are carrying %d or more streams, adding another\n",
+                (int) group.shards.size(), group.endpoint.c_str(), (int) channel_shard_max_streams);
+            if (add_channel_shard(group) != nullptr) {
+                least = group.shards.size() - 1;
+            }
+        }
+        index = least;
+    }
+
+    if (add_stream) {
+        group.shards[index]->active_streams++;
+    }
+    return group.shards[index];
+}
 
-    return grpc::CreateChannel(endpoint, creds);
+int df_set_channel_shards(size_t shards, size_t max_shards, size_t max_streams_per_shard)
+{
+    std::lock_guard<std::mutex> lock(channel_pool_lock);
+    channel_shard_count = std::max<size_t>(shards, 1);
+    channel_shard_max = std::max(max_shards, channel_shard_count);
+    channel_shard_max_streams = max_streams_per_shard;
+    return 0;
 }
 
 struct dialogflow_session *df_create_session(void *user_data)
@@ -138,16 +469,158 @@ struct dialogflow_session *df_create_session(void *user_data)
     session->state = DF_STATE_READY;
     session->user_data = user_data;
     session->endpoint = "dialogflow.googleapis.com";
+    session->event_fd = -1;
+    session->audio_ring_size = 0;
+    session->input_encoding = DF_AUDIO_ENCODING_MULAW;
+    session->input_sample_rate = 8000;
+    session->source_format = DF_SOURCE_AUDIO_NATIVE;
+    session->source_sample_rate = 8000;
+    session->output_audio_format = DF_OUTPUT_AUDIO_AS_SENT;
+    session->opus_bitrate = 0;
+    session->voice_gate_threshold = 0;
+    session->voice_gate_pre_roll_ms = 0;
+    session->voice_gate_trailing_ms = 0;
+    session->endpointer_threshold = 0;
+    session->endpointer_hangover_ms = 0;
+    session->endpointer_min_stability = 0;
+    session->end_of_speech_latency = -1;
+    session->start_pre_roll = 0;
+    session->coalesce_bytes = 0;
+    session->coalesce_delay_ms = 0;
+    session->raw_audio_writes = false;
+    session->closing = false;
+    session->results_log_pending = false;
+    session->event_stop_log_pending = false;
 
     df_log_call(session->user_data, "create", 0, nullptr);
 
     return session;
 }
 
+int df_set_global_event_callback(DF_EVENT_FUNC event_function)
+{
+    global_event_function = event_function;
+    return 0;
+}
+
+int df_set_event_callback(struct dialogflow_session *session, DF_EVENT_FUNC event_function)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    session->event_function = event_function;
+    return 0;
+}
+
+int df_get_event_fd(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (session->event_fd < 0) {
+        session->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (session->event_fd < 0) {
+            df_log(LOG_ERROR, "Failed to create event descriptor for %s - %s\n", session->session_id.c_str(), strerror(errno));
+        }
+    }
+    return session->event_fd;
+}
+
+int df_get_next_event(struct dialogflow_session *session, struct dialogflow_event *event)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (session->pending_events.empty()) {
+        if (session->event_fd >= 0) {
+            /* nothing left, so stop the descriptor polling readable */
+            uint64_t count;
+            ssize_t ignored = read(session->event_fd, &count, sizeof(count));
+            (void) ignored;
+        }
+        return 0;
+    }
+    session->current_event = std::move(session->pending_events.front());
+    session->pending_events.pop_front();
+    *event = session->current_event->event;
+    return 1;
+}
+
+static void queue_event_locked(struct dialogflow_session *session, const struct dialogflow_event& event)
+{
+    if (session->event_fd >= 0) {
+        uint64_t count = 1;
+        session->pending_events.push_back(std::unique_ptr<df_queued_event>(new df_queued_event(event)));
+        ssize_t ignored = write(session->event_fd, &count, sizeof(count));
+        (void) ignored;
+    }
+}
+
+/* states change on the caller's threads as well as the completion threads, so hosts only hear of them through the descriptor */
+static void set_state_locked(struct dialogflow_session *session, enum dialogflow_session_state state)
+{
+    if (session->state == state) {
+        return;
+    }
+    session->state = state;
+    struct dialogflow_event event = {};
+    event.type = DF_EVENT_STATE_CHANGED;
+    event.state = state;
+    queue_event_locked(session, event);
+}
+
+void df_emit_event(struct dialogflow_session *session, const struct dialogflow_event& event)
+{
+    std::unique_lock<std::mutex> lock(session->lock);
+    DF_EVENT_FUNC event_function = session->event_function ? session->event_function : global_event_function;
+    void *user_data = session->user_data;
+    queue_event_locked(session, event);
+    lock.unlock();
+
+    if (event_function) {
+        event_function(session, user_data, &event);
+    }
+}
+
+static void df_emit_error_event(struct dialogflow_session *session, const Status& status)
+{
+    /* error_message() returns a copy, keep it for the event */
+    std::string message = status.error_message();
+    struct dialogflow_event event = {};
+    event.type = DF_EVENT_ERROR;
+    event.text = message.c_str();
+    event.error_code = status.error_code();
+    df_emit_event(session, event);
+}
+
+/* output audio goes out as it arrives, in the format the session asked for */
+static void df_emit_output_audio(struct dialogflow_session *session, const std::string& audio)
+{
+    std::unique_lock<std::mutex> lock(session->lock);
+    enum dialogflow_output_audio_format format = session->output_audio_format;
+    std::string sessionId(session->session_id);
+    lock.unlock();
+
+    struct dialogflow_event event = {};
+    event.type = DF_EVENT_OUTPUT_AUDIO;
+    event.audio = audio.data();
+    event.audio_len = audio.length();
+
+    std::string converted;
+    if (format != DF_OUTPUT_AUDIO_AS_SENT) {
+        if (df_convert_output_audio(audio.data(), audio.length(), format, converted)) {
+            event.audio = converted.data();
+            event.audio_len = converted.length();
+        } else {
+            df_log(LOG_WARNING, "Output audio for %s isn't 16 bit linear mono, passing it on as sent\n", sessionId.c_str());
+        }
+    }
+    df_emit_event(session, event);
+}
+
 static void df_disconnect_locked(struct dialogflow_session *session)
 {
+    if (session->channel_group != nullptr) {
+        release_channel_group(session->channel_key);
+    }
     session->session = nullptr;
     session->channel = nullptr;
+    session->channel_shard = nullptr;
+    session->channel_group = nullptr;
 }
 
 int df_set_endpoint(struct dialogflow_session *session, const char *endpoint)
@@ -176,17 +649,48 @@ int df_set_auth_key(struct dialogflow_session *session, const char *auth_key)
     return 0;
 }
 
+/* wait for an outstanding df_recognize_event_async to complete */
+static void log_pending_results(struct dialogflow_session *session);
+
+static void wait_for_event_call(struct dialogflow_session *session, std::unique_lock<std::mutex>& lock)
+{
+    while (session->current_event_call != nullptr) {
+        std::shared_ptr<df_event_call> call(session->current_event_call);
+        lock.unlock();
+        call->wait();
+        lock.lock();
+        if (session->current_event_call == call) {
+            session->current_event_call = nullptr;
+        }
+    }
+}
+
 int df_close_session(struct dialogflow_session *session)
 {
+    if (refuse_on_completion_thread(session, "close synchronously")) {
+        return -1;
+    }
+
     std::unique_lock<std::mutex> lock(session->lock);
 
+    if (session->current_event_call != nullptr) {
+        session->current_event_call->cancel();
+        wait_for_event_call(session, lock);
+    }
+
     if (session->state != DF_STATE_READY) {
         lock.unlock();
         df_stop_recognition(session);
         lock.lock();
     }
     df_log(LOG_DEBUG, "Destroying channel to %s for %s\n", session->endpoint.c_str(), session->session_id.c_str());
+    df_disconnect_locked(session);
+    if (session->event_fd >= 0) {
+        close(session->event_fd);
+        session->event_fd = -1;
+    }
     lock.unlock();
+    log_pending_results(session);
     df_log_call(session->user_data, "destroy", 0, NULL);
 
     delete session;
@@ -256,46 +760,164 @@ static std::string format(const std::string& format, ...)
     return &vec[0];
 }
 
-static std::string make_indexed_name(std::string name, int index)
+static const char *make_indexed_name(char *buffer, size_t size, const char *name, int index)
 {
     if (index == 0) {
         return name;
-    } else {
-        return format("%s_%d", name.c_str(), index);
     }
+    snprintf(buffer, size, "%s_%d", name, index);
+    return buffer;
+}
+
+df_result_table::df_result_table() : blocks_used(0)
+{
+}
+
+void df_result_table::clear()
+{
+    for (size_t i = 0; i < blocks_used; i++) {
+        blocks[i].clear();
+    }
+    blocks_used = 0;
+    results.clear();
+    shared_values.clear();
+    by_name.clear();
+}
+
+/* copies data in nul terminated, it may also hold nuls of its own */
+const char *df_result_table::store(const char *data, size_t length)
+{
+    if (blocks_used == 0 || blocks[blocks_used - 1].capacity() - blocks[blocks_used - 1].size() < length + 1) {
+        if (blocks_used == blocks.size()) {
+            blocks.emplace_back();
+        }
+        blocks[blocks_used++].reserve(std::max(length + 1, size_t(DF_RESULT_BLOCK_BYTES)));
+    }
+    std::string& block = blocks[blocks_used - 1];
+    size_t offset = block.size();
+    block.append(data, length);
+    block += '\0';
+    return &block[offset];
 }
 
-static void push_parameter_result(std::vector<std::unique_ptr<df_result>> &results, const std::string &name, const ::google::protobuf::Value &value, int score)
+void df_result_table::add(const char *slot, size_t slot_length, const char *value, size_t value_length, int score)
 {
+    struct dialogflow_result added;
+    added.slot = store(slot, slot_length);
+    added.value = store(value, value_length);
+    added.valueLen = value_length;
+    added.score = score;
+    results.push_back(added);
+}
+
+void df_result_table::add_shared(const char *slot, std::shared_ptr<const std::string> value, int score)
+{
+    struct dialogflow_result added;
+    added.slot = store(slot, strlen(slot));
+    added.value = value->c_str();
+    added.valueLen = value->length();
+    added.score = score;
+    results.push_back(added);
+    shared_values.push_back(std::move(value));
+}
+
+struct dialogflow_result *df_result_table::get(size_t index)
+{
+    return index < results.size() ? &results[index] : nullptr;
+}
+
+void df_result_table::index_names()
+{
+    if (by_name.size() == results.size()) {
+        return;
+    }
+    by_name.resize(results.size());
+    for (size_t i = 0; i < by_name.size(); i++) {
+        by_name[i] = i;
+    }
+    /* stable, so a repeated name finds the one added first */
+    std::stable_sort(by_name.begin(), by_name.end(), [this](size_t a, size_t b) {
+        return strcmp(results[a].slot, results[b].slot) < 0;
+    });
+}
+
+int df_result_table::find(const char *name)
+{
+    index_names();
+    auto found = std::lower_bound(by_name.begin(), by_name.end(), name, [this](size_t index, const char *name) {
+        return strcmp(results[index].slot, name) < 0;
+    });
+    if (found == by_name.end() || strcmp(results[*found].slot, name)) {
+        return -1;
+    }
+    return int(*found);
+}
+
+/* the names sharing a prefix sit together in the index, but are returned in the order they were added */
+int df_result_table::find_prefix(const char *prefix, size_t position)
+{
+    size_t prefix_length = strlen(prefix);
+    int next = -1;
+
+    index_names();
+    auto found = std::lower_bound(by_name.begin(), by_name.end(), prefix, [this](size_t index, const char *prefix) {
+        return strcmp(results[index].slot, prefix) < 0;
+    });
+    for (; found != by_name.end() && !strncmp(results[*found].slot, prefix, prefix_length); found++) {
+        if (*found >= position && (next < 0 || *found < size_t(next))) {
+            next = int(*found);
+        }
+    }
+    return next;
+}
+
+static void clear_results(struct dialogflow_session *session)
+{
+    session->results.clear();
+    session->result_source = df_result_source();
+    session->results_log_pending = false;
+    session->event_stop_log_pending = false;
+    session->output_audio = nullptr;
+}
+
+/* name is the slot name so far, extended in place for nested values and put back before returning */
+static void push_parameter_result(df_result_table& results, std::string& name, const ::google::protobuf::Value& value, int score)
+{
+    size_t name_length = name.length();
     ::google::protobuf::Value::KindCase kind = value.kind_case();
     if (kind == ::google::protobuf::Value::KindCase::kStructValue) {
         /* nested */
-        ::google::protobuf::Map<std::string, ::google::protobuf::Value> parameters = value.struct_value().fields();
-        for (auto iterator = parameters.begin(); iterator != parameters.end(); ++iterator) {
-            const std::string subname = iterator->first;
-            const ::google::protobuf::Value subvalue = iterator->second;
-            push_parameter_result(results, name + "_" + subname, subvalue, score);
+        for (const auto& field : value.struct_value().fields()) {
+            name += '_';
+            name += field.first;
+            push_parameter_result(results, name, field.second, score);
+            name.resize(name_length);
         }
     } else if (kind == ::google::protobuf::Value::KindCase::kListValue) {
         /* nested-ish */
-        const ::google::protobuf::ListValue list_value = value.list_value();
+        const ::google::protobuf::ListValue& list_value = value.list_value();
         int list_size = list_value.values_size();
         for (int i = 0; i < list_size; i++) {
-            const ::google::protobuf::Value sub_value = list_value.values(i);
-            push_parameter_result(results, name + "_" + std::to_string(i), sub_value, score);
+            name += '_';
+            name += std::to_string(i);
+            push_parameter_result(results, name, list_value.values(i), score);
+            name.resize(name_length);
         }
     } else {
         /* simple value */
-        std::string result;
+        char number[32];
+        const char *result;
+        size_t result_length;
         switch (kind) {
             case ::google::protobuf::Value::KindCase::kNullValue:
                 result = "null";
                 break;
             case ::google::protobuf::Value::KindCase::kNumberValue:
-                result = std::to_string(value.number_value());
+                snprintf(number, sizeof(number), "%f", value.number_value());
+                result = number;
                 break;
             case ::google::protobuf::Value::KindCase::kStringValue:
-                result = value.string_value();
+                result = value.string_value().data();
                 break;
             case ::google::protobuf::Value::KindCase::kBoolValue:
                 result = value.bool_value() ? "true" : "false";
@@ -304,33 +926,45 @@ static void push_parameter_result(std::vector<std::unique_ptr<df_result>> &resul
                 result = "unknown type";
                 break;
         }
-        results.push_back(std::unique_ptr<df_result>(new df_result(name, result, score)));
+        result_length = kind == ::google::protobuf::Value::KindCase::kStringValue ? value.string_value().length() : strlen(result);
+        results.add(name.data(), name.length(), result, result_length, score);
     }
 }
 
-static void make_query_result_responses(struct dialogflow_session *session, const QueryResult &query_result, int score)
+static void add_number_result(df_result_table& results, const char *slot, double value, int score)
+{
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%f", value);
+    results.add(slot, strlen(slot), number, length, score);
+}
+
+static void make_query_fields_results(df_result_table& results, const QueryResult &query_result, int score)
+{
+    results.add("query_text", query_result.query_text(), score);
+    results.add("language_code", query_result.language_code(), score);
+    results.add("action", query_result.action(), score);
+    results.add("fulfillment_text", query_result.fulfillment_text(), score);
+    results.add("intent_name", query_result.intent().name(), score);
+    results.add("intent_display_name", query_result.intent().display_name(), score);
+    add_number_result(results, "intent_detection_confidence", query_result.intent_detection_confidence(), score);
+}
+
+static void make_fulfillment_message_results(df_result_table& results, const QueryResult &query_result, int score)
 {
+    char slot[64];
     int text_count = 0;
     int simple_response_count = 0;
     int play_audio_count = 0;
     int synthesize_speech_count = 0;
     int transfer_call_count = 0;
 
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("query_text", query_result.query_text(), score)));
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("language_code", query_result.language_code(), score)));
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("action", query_result.action(), score)));
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("fulfillment_text", query_result.fulfillment_text(), score)));
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("intent_name", query_result.intent().name(), score)));
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("intent_display_name", query_result.intent().display_name(), score)));
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("intent_detection_confidence", format("%f", query_result.intent_detection_confidence()), score)));
-
     int msgs = query_result.fulfillment_messages_size();
     for (int i = 0; i < msgs; i++) {
         const ::google::cloud::dialogflow::v2beta1::Intent_Message& msg = query_result.fulfillment_messages(i);
         if (msg.has_text()) {
             int texts = msg.text().text_size();
             for (int j = 0; j < texts; j++) {
-                session->results.push_back(std::unique_ptr<df_result>(new df_result(make_indexed_name("text", text_count++), msg.text().text(j), score)));
+                results.add(make_indexed_name(slot, sizeof(slot), "text", text_count++), msg.text().text(j), score);
             }
         } else if (msg.has_simple_responses()) {
             int rspns = msg.simple_responses().simple_responses_size();
@@ -338,90 +972,129 @@ static void make_query_result_responses(struct dialogflow_session *session, cons
                 const std::string& tts = msg.simple_responses().simple_responses(j).text_to_speech();
                 const std::string& ssml = msg.simple_responses().simple_responses(j).ssml();
 
-                session->results.push_back(std::unique_ptr<df_result>(new df_result(make_indexed_name("simple_response", simple_response_count++),
-                    tts.length() ? tts : ssml, score)));
+                results.add(make_indexed_name(slot, sizeof(slot), "simple_response", simple_response_count++), tts.length() ? tts : ssml, score);
             }
         } else if (msg.has_telephony_play_audio()) {
-            session->results.push_back(std::unique_ptr<df_result>(new df_result(make_indexed_name("play_audio", play_audio_count++),
-                msg.telephony_play_audio().audio_uri(), score)));
+            results.add(make_indexed_name(slot, sizeof(slot), "play_audio", play_audio_count++), msg.telephony_play_audio().audio_uri(), score);
         } else if (msg.has_telephony_synthesize_speech()) {
             const std::string& tts = msg.telephony_synthesize_speech().text();
             const std::string& ssml = msg.telephony_synthesize_speech().ssml();
-            session->results.push_back(std::unique_ptr<df_result>(new df_result(make_indexed_name("synthesize_speech", synthesize_speech_count++),
-                tts.length() ? tts : ssml, score)));
+            results.add(make_indexed_name(slot, sizeof(slot), "synthesize_speech", synthesize_speech_count++), tts.length() ? tts : ssml, score);
         } else if (msg.has_telephony_transfer_call()) {
-            session->results.push_back(std::unique_ptr<df_result>(new df_result(make_indexed_name("transfer_call", transfer_call_count++),
-                msg.telephony_transfer_call().phone_number(), score)));
+            results.add(make_indexed_name(slot, sizeof(slot), "transfer_call", transfer_call_count++), msg.telephony_transfer_call().phone_number(), score);
         }
     }
+}
 
-    ::google::protobuf::Map<std::string, ::google::protobuf::Value> parameters = query_result.parameters().fields();
-    for (auto iterator = parameters.begin(); iterator != parameters.end(); ++iterator) {
-        const std::string name = iterator->first;
-        const ::google::protobuf::Value value = iterator->second;
-        push_parameter_result(session->results, name, value, score);
+static void make_parameter_results(df_result_table& results, const QueryResult &query_result, int score)
+{
+    std::string name;
+    for (const auto& parameter : query_result.parameters().fields()) {
+        name = parameter.first;
+        push_parameter_result(results, name, parameter.second, score);
     }
+}
 
-    if (query_result.has_sentiment_analysis_result() && query_result.sentiment_analysis_result().has_query_text_sentiment()) {
-        auto sentiment = query_result.sentiment_analysis_result().query_text_sentiment();
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("sentiment_score", format("%f", sentiment.score()), score)));
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("sentiment_magnitude", format("%f", sentiment.magnitude()), score)));
+/* the output audio is shared between the response it came in, the session and the results rather than copied */
+static void make_audio_result(struct dialogflow_session *session, int score)
+{
+    const std::shared_ptr<const std::string>& audio = session->output_audio;
+    if (audio == nullptr) {
+        return;
+    }
+    struct dialogflow_output_audio wav;
+    if (!df_parse_wav(audio->data(), audio->length(), &wav)) {
+        df_log(LOG_WARNING, "Got output_audio for %s without a usable WAV header\n", session->session_id.c_str());
+        return;
     }
+    session->results.add_shared("output_audio", audio, score);
 }
 
-template<typename T> static void make_audio_result(struct dialogflow_session *session, T& response, int score)
+/* adds the next part of the results from the session's result source, in the order they've always come in.
+   false once they're all there. called with the session locked */
+static bool flatten_next_result_part(struct dialogflow_session *session)
 {
-    if (response.output_audio().length() > 0) {
-        const char *audio = response.output_audio().c_str();
-        if (!strncmp(audio, "RIFF", 4)) {
-            /* looks like a wave file */
-            int32_t chunkSize = *((int32_t*)(audio + 4));
-            if (chunkSize > 0) {
-                /* so far so good */
-                try {
-                    /* verify the array is valid... */
-                    char a = audio[chunkSize + 8 - 1];
-                    a = a; /* prevent the compiler complaining about the unused variable */
-                    session->results.push_back(std::unique_ptr<df_result>(new df_result("output_audio", audio, chunkSize + 8, score)));
-                } catch (const std::exception& e) {
-                    df_log(LOG_WARNING, "Got exception poking end of audio array for output_audio for %s\n", session->session_id.c_str());
-                }
-            } else {
-                df_log(LOG_WARNING, "Got output_audio for %s with a non-positive RIFF chunk size - %d", session->session_id.c_str(), chunkSize);
-            }
-        } else {
-            df_log(LOG_WARNING, "Got output_audio for %s without a RIFF header\n", session->session_id.c_str());
+    df_result_source& source = session->result_source;
+    df_result_table& results = session->results;
+    int score = source.score;
+
+    if (source.query_result == nullptr || source.parts_flattened == DF_RESULT_PARTS) {
+        return false;
+    }
+    const QueryResult& query_result = *source.query_result;
+    switch (source.parts_flattened++) {
+    case 0:
+        results.add("response_id", *source.response_id, score);
+        make_audio_result(session, score);
+        make_query_fields_results(results, query_result, score);
+        break;
+    case 1:
+        make_fulfillment_message_results(results, query_result, score);
+        break;
+    case 2:
+        make_parameter_results(results, query_result, score);
+        break;
+    default:
+        if (query_result.has_sentiment_analysis_result() && query_result.sentiment_analysis_result().has_query_text_sentiment()) {
+            const auto& sentiment = query_result.sentiment_analysis_result().query_text_sentiment();
+            add_number_result(results, "sentiment_score", sentiment.score(), score);
+            add_number_result(results, "sentiment_magnitude", sentiment.magnitude(), score);
         }
+        if (source.recognition_result != nullptr) {
+            add_number_result(results, "speech_score", source.recognition_result->confidence(), score);
+        }
+        results.add("alternate_result_count", std::to_string(source.alternate_result_count), score);
+        break;
+    }
+    return true;
+}
+
+static void flatten_results(struct dialogflow_session *session)
+{
+    while (flatten_next_result_part(session)) {
     }
 }
 
-static void log_responses(struct dialogflow_session *session, int score)
+/* the "results" call log entry waits until the recognition is stopped, the session moves on to another or is closed,
+   so neither the completion thread that got them nor a caller reading a single result flattens them all just to log
+   them. an async event's "stop" entry waits with it to keep it after the results */
+static void log_pending_results(struct dialogflow_session *session)
 {
+    if (df_log_call == noop_call_log || !session->results_log_pending.exchange(false)) {
+        return;
+    }
+
     std::unique_lock<std::mutex> lock(session->lock);
+    flatten_results(session);
     size_t response_count = session->results.size();
     size_t log_data_size = response_count + 1; /* for score */
     struct dialogflow_log_data log_data[log_data_size];
     size_t i;
-    std::string score_string = std::to_string(score);
+    std::string score_string = std::to_string(session->result_source.score);
 
     log_data[0].name = "score";
     log_data[0].value = score_string.c_str();
     log_data[0].value_type = dialogflow_log_data_value_type_string;
     
     for (i = 0; i < response_count; i++) {
+        struct dialogflow_result *result = session->results.get(i);
         log_data[i + 1].value_type = dialogflow_log_data_value_type_string;
-        log_data[i + 1].name = session->results[i]->slot.c_str();
-        if (session->results[i]->slot == "output_audio") {
+        log_data[i + 1].name = result->slot;
+        if (!strcmp(result->slot, "output_audio")) {
             log_data[i + 1].value = "audio data";
         } else {
-            log_data[i + 1].value = session->results[i]->value.c_str();
+            log_data[i + 1].value = result->value;
         }
     }
 
     lock.unlock();
     df_log_call(session->user_data, "results", log_data_size, log_data);
+    if (session->event_stop_log_pending.exchange(false)) {
+        df_log_call(session->user_data, "stop", 0, NULL);
+    }
 }
 
+/* the results are only flattened once they're read, all that happens here is holding on to the responses */
 static void make_streaming_responses(struct dialogflow_session *session)
 {
     std::unique_lock<std::mutex> lock(session->lock);
@@ -439,37 +1112,40 @@ static void make_streaming_responses(struct dialogflow_session *session)
         query_result.fulfillment_messages
     */
     if (session->final_response) {
-        int score = int(session->final_response->query_result().intent_detection_confidence() * 100);
-        session->results.clear();
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("response_id", session->final_response->response_id(), score)));
-        
-        if (session->audio_response) {
-            make_audio_result<StreamingDetectIntentResponse>(session, *session->audio_response, score);
-        }
-        make_query_result_responses(session, session->final_response->query_result(), score);
+        const std::shared_ptr<StreamingDetectIntentResponse>& response = session->final_response;
+        clear_results(session);
+        df_result_source& source = session->result_source;
+        source.response = response;
+        source.score = int(response->query_result().intent_detection_confidence() * 100);
+        source.response_id = std::shared_ptr<const std::string>(response, &response->response_id());
+        source.query_result = std::shared_ptr<const QueryResult>(response, &response->query_result());
+        source.alternate_result_count = response->alternative_query_results_size();
         if (session->transcription_response) {
-            float speech_score = session->transcription_response->recognition_result().confidence();
-            session->results.push_back(std::unique_ptr<df_result>(new df_result("speech_score", std::to_string(speech_score), score)));
+            source.recognition_result = std::shared_ptr<const StreamingRecognitionResult>(session->transcription_response,
+                &session->transcription_response->recognition_result());
+        }
+        if (session->audio_response && !session->audio_response->output_audio().empty()) {
+            session->output_audio = std::shared_ptr<const std::string>(session->audio_response, &session->audio_response->output_audio());
         }
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("alternate_result_count", std::to_string(session->final_response->alternative_query_results_size()), score)));
 
-        lock.unlock();
-        log_responses(session, score);
+        session->results_log_pending = true;
     }
 }
 
-static void make_synchronous_responses(struct dialogflow_session *session, DetectIntentResponse& response)
+static void make_synchronous_responses(struct dialogflow_session *session, const std::shared_ptr<DetectIntentResponse>& response)
 {
     std::unique_lock<std::mutex> lock(session->lock);
-    int score = int(response.query_result().intent_detection_confidence() * 100);
-    session->results.clear();
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("response_id", response.response_id(), score)));
-    
-    make_audio_result<DetectIntentResponse>(session, response, score);
-    make_query_result_responses(session, response.query_result(), score);
-    session->results.push_back(std::unique_ptr<df_result>(new df_result("alternate_result_count", std::to_string(response.alternative_query_results_size()), score)));
-    lock.unlock();
-    log_responses(session, score);
+    clear_results(session);
+    df_result_source& source = session->result_source;
+    source.response = response;
+    source.score = int(response->query_result().intent_detection_confidence() * 100);
+    source.response_id = std::shared_ptr<const std::string>(response, &response->response_id());
+    source.query_result = std::shared_ptr<const QueryResult>(response, &response->query_result());
+    source.alternate_result_count = response->alternative_query_results_size();
+    if (!response->output_audio().empty()) {
+        session->output_audio = std::shared_ptr<const std::string>(response, &response->output_audio());
+    }
+    session->results_log_pending = true;
 }
 
 static bool is_session_connected(struct dialogflow_session *session)
@@ -481,7 +1157,12 @@ static void ensure_connected(struct dialogflow_session *session)
 {
     std::unique_lock<std::mutex> lock(session->lock);
     if (!is_session_connected(session)) {
-        session->channel = create_grpc_channel(session->endpoint, session->auth_key);
+        session->channel_key = make_channel_pool_key(session->endpoint, session->auth_key);
+        session->channel_group = acquire_channel_group(session->channel_key, session->endpoint, session->auth_key);
+        if (session->channel_group != nullptr) {
+            session->channel_shard = select_channel_shard(*session->channel_group, session->session_id, false);
+            session->channel = session->channel_shard->channel;
+        }
         if (session->channel == nullptr) {
             df_log(LOG_ERROR, "Failed to create channel to %s for %s\n", session->endpoint.c_str(), session->session_id.c_str());
         } else {
@@ -503,9 +1184,19 @@ void df_connect(struct dialogflow_session *session)
     ensure_connected(session);
 }
 
-int df_recognize_event(struct dialogflow_session *session, const char *event, const char *language, int request_audio)
+/* everything up to sending the DetectIntent request for an event, with the session locked */
+static int df_prepare_event_request(struct dialogflow_session *session, std::unique_lock<std::mutex>& lock, const char *event, const char *language, int request_audio,
+    DetectIntentRequest& request)
 {
-    std::unique_lock<std::mutex> lock(session->lock);
+    if (session->closing) {
+        df_log(LOG_WARNING, "Session %s is closing, not detecting event %s\n", session->session_id.c_str(), event);
+        return -1;
+    }
+    if (refuse_on_completion_thread(session, "detect an event")) {
+        return -1;
+    }
+
+    wait_for_event_call(session, lock);
 
     if (session->state != DF_STATE_READY) {
         lock.unlock();
@@ -514,12 +1205,13 @@ int df_recognize_event(struct dialogflow_session *session, const char *event, co
     }
 
     lock.unlock();
+    log_pending_results(session);
     ensure_connected(session);
     lock.lock();
 
     if (!is_session_connected(session)) {
-        session->results.clear();
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("error", "Failed to connect", 100)));
+        clear_results(session);
+        session->results.add("error", "Failed to connect", 100);
         return -1;
     }
 
@@ -531,10 +1223,6 @@ int df_recognize_event(struct dialogflow_session *session, const char *event, co
 
     df_log(LOG_DEBUG, "Session %s performing event recognition on %s\n", session->session_id.c_str(), session_path.c_str());
 
-    DetectIntentRequest request;
-    DetectIntentResponse response;
-    ClientContext context;
-
     request.set_session(session_path);
     if (request_audio) {
         request.mutable_output_audio_config()->set_audio_encoding(google::cloud::dialogflow::v2beta1::OutputAudioEncoding::OUTPUT_AUDIO_ENCODING_LINEAR_16);
@@ -558,389 +1246,1693 @@ int df_recognize_event(struct dialogflow_session *session, const char *event, co
 
     session->session_start_time = tvnow();
     session->last_transcription_time = tvnow();
-    Status status = session->session->DetectIntent(&context, request, &response);
+
+    return 0;
+}
+
+/* turn the outcome of an event's DetectIntent into results, called without the session locked. on a completion thread
+   the "results" and "stop" entries are left for log_pending_results */
+static int df_finish_event_request(struct dialogflow_session *session, const Status& status, const std::shared_ptr<DetectIntentResponse>& response,
+    bool on_completion_thread)
+{
+    std::unique_lock<std::mutex> lock(session->lock);
+
     session->intent_detected_time = tvnow();
     if (!status.ok()) {
         df_log(LOG_WARNING, "Session %s got error performing event detection on %s: %s (%d: %s)\n", session->session_id.c_str(), session->project_id.c_str(),
             status.error_message().c_str(), status.error_code(), status.error_details().c_str());
-        session->state = DF_STATE_READY;
+        set_state_locked(session, DF_STATE_READY);
         std::string error_code_string = std::to_string(status.error_code());
+        std::string error_message = status.error_message();
+        std::string error_details = status.error_details();
         struct dialogflow_log_data log_data[] = {
-            { "message", status.error_message().c_str() },
-            { "details", status.error_details().c_str() }, 
+            { "message", error_message.c_str() },
+            { "details", error_details.c_str() }, 
             { "error_code", error_code_string.c_str() }
         };
         lock.unlock();
         df_log_call(session->user_data, "error", 3, log_data);
         lock.lock();
-        session->results.clear();
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("error", status.error_message(), 100)));
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("error_details", status.error_details(), 100)));
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("error_code", error_code_string, 100)));
+        clear_results(session);
+        session->results.add("error", error_message, 100);
+        session->results.add("error_details", error_details, 100);
+        session->results.add("error_code", error_code_string, 100);
         return -1;
     }
 
     if (session->debug) {
-        df_log(LOG_DEBUG, "RESPONSE: %s\n", response.ShortDebugString().c_str());
+        df_log(LOG_DEBUG, "RESPONSE: %s\n", response->ShortDebugString().c_str());
     }
 
     lock.unlock();
 
     make_synchronous_responses(session, response);
-    df_log_call(session->user_data, "stop", 0, NULL);
+    if (on_completion_thread) {
+        session->event_stop_log_pending = true;
+    } else {
+        log_pending_results(session);
+        df_log_call(session->user_data, "stop", 0, NULL);
+    }
 
     lock.lock();
     session->responsesReceived = 1;
-    session->state = DF_STATE_READY;
+    set_state_locked(session, DF_STATE_READY);
+
+    return 0;
+}
+
+int df_recognize_event(struct dialogflow_session *session, const char *event, const char *language, int request_audio)
+{
+    std::unique_lock<std::mutex> lock(session->lock);
+    DetectIntentRequest request;
+
+    if (df_prepare_event_request(session, lock, event, language, request_audio, request)) {
+        return -1;
+    }
+
+    /* the session stays usable, df_get_state and friends included, while the request is out */
+    std::shared_ptr<Sessions::StubInterface> stub(session->session);
+    lock.unlock();
+
+    std::shared_ptr<DetectIntentResponse> response = std::make_shared<DetectIntentResponse>();
+    ClientContext context;
+    Status status = stub->DetectIntent(&context, request, response.get());
+
+    return df_finish_event_request(session, status, response, false);
+}
+
+int df_recognize_event_async(struct dialogflow_session *session, const char *event, const char *language, int request_audio)
+{
+    std::unique_lock<std::mutex> lock(session->lock);
+    DetectIntentRequest request;
+
+    if (df_prepare_event_request(session, lock, event, language, request_audio, request)) {
+        return -1;
+    }
+
+    std::shared_ptr<df_event_call> call = std::make_shared<df_event_call>(session);
+    call->stub = session->session;
+    call->reader = call->stub->PrepareAsyncDetectIntent(&call->context, request, get_completion_queue());
+    call->reader->StartCall();
+    session->current_event_call = call;
+    call->reader->Finish(call->response.get(), &call->status, call.get());
 
     return 0;
 }
 
+void df_event_call::complete(bool ok)
+{
+    /* the session may drop its reference once results are in, keep ourselves around until we're done */
+    std::shared_ptr<df_event_call> reference;
+    {
+        std::lock_guard<std::mutex> session_lock(session->lock);
+        reference = session->current_event_call;
+    }
+
+    if (df_finish_event_request(session, status, response, true) == 0) {
+        struct dialogflow_event event = {};
+        event.type = DF_EVENT_QUERY_RESULT;
+        event.text = response->query_result().query_text().c_str();
+        event.confidence = response->query_result().intent_detection_confidence();
+        event.intent_display_name = response->query_result().intent().display_name().c_str();
+        event.action = response->query_result().action().c_str();
+        event.fulfillment_text = response->query_result().fulfillment_text().c_str();
+        df_emit_event(session, event);
+
+        if (!response->output_audio().empty()) {
+            df_emit_output_audio(session, response->output_audio());
+        }
+    } else {
+        df_emit_error_event(session, status);
+    }
+
+    struct dialogflow_event finished_event = {};
+    finished_event.type = DF_EVENT_FINISHED;
+    finished_event.error_code = status.error_code();
+    df_emit_event(session, finished_event);
+
+    std::unique_lock<std::mutex> lock(this->lock);
+    finished = true;
+    cond.notify_all();
+    lock.unlock();
+
+    wake_reaper();
+}
+
+void df_event_call::cancel()
+{
+    context.TryCancel();
+}
+
+bool df_event_call::is_finished()
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    return finished;
+}
+
+void df_event_call::wait()
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    cond.wait(lock, [this] { return finished; });
+}
+
+static void flush_converted_audio(struct dialogflow_session *session, df_stream_call *call);
+
 void maybe_stop_session_writes(struct dialogflow_session *session)
 {
     std::unique_lock<std::mutex> lock(session->lock);
-    if (session->writes_done == false) {
-        session->writes_done = true;
-        session->current_request->WritesDone();
+    /* df_write_audio's end of speech can get here while df_stop_recognition is dropping the call */
+    std::shared_ptr<df_stream_call> call(std::atomic_load(&session->current_request));
+    if (call == nullptr || session->writes_done) {
+        return;
+    }
+    session->writes_done = true;
+    lock.unlock();
+    /* an opus stream still needs its last frame and end of stream page */
+    flush_converted_audio(session, call.get());
+    call->writes_done();
+    lock.lock();
+
+    /* how far behind the speech the writes ended, when something was listening for it */
+    timeval last_speech = session->last_speech_time;
+    if (last_speech.tv_sec == 0) {
         lock.unlock();
         df_log_call(session->user_data, "end_write", 0, NULL);
+        return;
     }
+    session->end_of_speech_latency = (int) tvdiff_ms(tvnow(), last_speech);
+    std::string latency = std::to_string(session->end_of_speech_latency);
+    struct dialogflow_log_data log_data[] = {
+        { "end_of_speech_latency_ms", latency.c_str() }
+    };
+    lock.unlock();
+    df_log_call(session->user_data, "end_write", ARRAY_LEN(log_data), log_data);
 }
 
-static void df_read_exec(struct dialogflow_session *session)
+/* called on a completion queue thread for each response read from the stream */
+static void df_read_response(struct dialogflow_session *session, const std::shared_ptr<StreamingDetectIntentResponse>& read)
 {
-    StreamingDetectIntentResponse response;
+    const StreamingDetectIntentResponse& response = *read;
     bool debug;
     void *user_data;
 
+    session->responsesReceived++;
+
     std::unique_lock<std::mutex> lock(session->lock);
     std::string sessionId(session->session_id);
-    std::shared_ptr<ClientReaderWriterInterface<StreamingDetectIntentRequest, StreamingDetectIntentResponse>> 
-        current_request(session->current_request);
     debug = session->debug;
     user_data = session->user_data;
     lock.unlock();
-    while (current_request->Read(&response)) {
+
+    if (debug) {
+        df_log(LOG_DEBUG, "RESPONSE: %s\n", response.ShortDebugString().c_str());
+    }
+    if (response.has_query_result()) {
+        // this is the final response
+        df_log(LOG_DEBUG, "Got final response '%s' (\"%s\" / \"%s\") for %s\n", 
+            response.query_result().intent().display_name().c_str(),
+            response.query_result().query_text().c_str(),
+            response.query_result().fulfillment_text().c_str(),
+            sessionId.c_str());
+        if (response.output_audio().length() > 0) {
+            df_log(LOG_DEBUG, "Final response has audio\n");
+        }
+        if (response.has_output_audio_config()) {
+            df_log(LOG_DEBUG, "Final response has audio config\n");
+        }
         lock.lock();
-        session->responsesReceived++;
-        debug = session->debug;
+        session->intent_detected_time = tvnow();
+        session->final_response = read;
         lock.unlock();
-        if (debug) {
-            df_log(LOG_DEBUG, "RESPONSE: %s\n", response.ShortDebugString().c_str());
-        }
-        if (response.has_query_result()) {
-            // this is the final response
-            df_log(LOG_DEBUG, "Got final response '%s' (\"%s\" / \"%s\") for %s\n", 
-                response.query_result().intent().display_name().c_str(),
-                response.query_result().query_text().c_str(),
-                response.query_result().fulfillment_text().c_str(),
+        struct dialogflow_log_data log_data[] = {
+            { "intent", response.query_result().intent().display_name().c_str() },
+            { "action", response.query_result().action().c_str() },
+            { "fulfillment_text", response.query_result().fulfillment_text().c_str() },
+        };
+        df_log_call(user_data, "query_result_received", 3, log_data);
+
+        struct dialogflow_event event = {};
+        event.type = DF_EVENT_QUERY_RESULT;
+        event.text = response.query_result().query_text().c_str();
+        event.confidence = response.query_result().intent_detection_confidence();
+        event.intent_display_name = response.query_result().intent().display_name().c_str();
+        event.action = response.query_result().action().c_str();
+        event.fulfillment_text = response.query_result().fulfillment_text().c_str();
+        df_emit_event(session, event);
+    } else if (response.has_recognition_result()) {
+        if (response.recognition_result().message_type() == 
+            google::cloud::dialogflow::v2beta1::StreamingRecognitionResult_MessageType::
+            StreamingRecognitionResult_MessageType_END_OF_SINGLE_UTTERANCE) {
+            df_log(LOG_DEBUG, "Got end of single utterance event for %s\n",
+                sessionId.c_str());
+            df_log_call(user_data, "end_of_utterance", 0, NULL);
+
+            struct dialogflow_event event = {};
+            event.type = DF_EVENT_END_OF_UTTERANCE;
+            df_emit_event(session, event);
+        } else {
+            double offset_as_double = (double) response.recognition_result().speech_end_offset().seconds() + 
+                ((double) response.recognition_result().speech_end_offset().nanos() / 1000000000);
+            std::string offset = format("%f", (float) offset_as_double);
+            df_log(LOG_DEBUG, "Got %s transcription '%s' for %s\n",
+                response.recognition_result().is_final() ? "final" : "interim",
+                response.recognition_result().transcript().c_str(),
                 sessionId.c_str());
-            grpc::string audio = response.output_audio();
-            if (audio.length() > 0) {
-                df_log(LOG_DEBUG, "Final response has audio\n");
+            if (response.output_audio().length() > 0) {
+                df_log(LOG_DEBUG, "Interim response has audio\n");
             }
             if (response.has_output_audio_config()) {
-                df_log(LOG_DEBUG, "Final response has audio config\n");
+                df_log(LOG_DEBUG, "Interim response has audio config\n");
             }
-            lock.lock();
-            session->intent_detected_time = tvnow();
-            session->final_response = std::make_shared<StreamingDetectIntentResponse>(response);
-            lock.unlock();
-            struct dialogflow_log_data log_data[] = {
-                { "intent", response.query_result().intent().display_name().c_str() },
-                { "action", response.query_result().action().c_str() },
-                { "fulfillment_text", response.query_result().fulfillment_text().c_str() },
-            };
-            df_log_call(user_data, "query_result_received", 3, log_data);
-        } else if (response.has_recognition_result()) {
-            if (response.recognition_result().message_type() == 
-                google::cloud::dialogflow::v2beta1::StreamingRecognitionResult_MessageType::
-                StreamingRecognitionResult_MessageType_END_OF_SINGLE_UTTERANCE) {
-                df_log(LOG_DEBUG, "Got end of single utterance event for %s\n",
-                    sessionId.c_str());
-                df_log_call(user_data, "end_of_utterance", 0, NULL);
-            } else {
-                double offset_as_double = (double) response.recognition_result().speech_end_offset().seconds() + 
-                    ((double) response.recognition_result().speech_end_offset().nanos() / 1000000000);
-                std::string offset = format("%f", (float) offset_as_double);
-                df_log(LOG_DEBUG, "Got %s transcription '%s' for %s\n",
-                    response.recognition_result().is_final() ? "final" : "interim",
-                    response.recognition_result().transcript().c_str(),
-                    sessionId.c_str());
-                if (response.output_audio().length() > 0) {
-                    df_log(LOG_DEBUG, "Interim response has audio\n");
-                }
-                if (response.has_output_audio_config()) {
-                    df_log(LOG_DEBUG, "Interim response has audio config\n");
-                }
-                if (response.recognition_result().is_final()) {
-                    bool stop_writes;
-                    std::string score = std::to_string(response.recognition_result().confidence());
-                    struct dialogflow_log_data log_data[] = { 
-                        { "text", response.recognition_result().transcript().c_str() },
-                        { "score", score.c_str() },
-                        { "offset", offset.c_str() }
-                    };
-                    df_log_call(user_data, "final_transcription", ARRAY_LEN(log_data), log_data);
-                    lock.lock();
-                    session->last_transcription_time = tvnow();
-                    session->transcription_response = std::make_shared<StreamingDetectIntentResponse>(response);
-                    stop_writes = session->stop_writes_on_final_transcription;
-                    lock.unlock();
-                    if (stop_writes) {
-                        maybe_stop_session_writes(session);
-                    }
-                } else {
-                    std::string stability = std::to_string(response.recognition_result().stability());
-                    struct dialogflow_log_data log_data[] = { 
-                        { "text", response.recognition_result().transcript().c_str() },
-                        { "stability", stability.c_str() },
-                        { "offset", offset.c_str() }
-                    };
-                    df_log_call(user_data, "transcription", ARRAY_LEN(log_data), log_data);
-                    lock.lock();
-                    session->last_transcription_time = tvnow();
-                    lock.unlock();
+            if (response.recognition_result().is_final()) {
+                bool stop_writes;
+                std::string score = std::to_string(response.recognition_result().confidence());
+                struct dialogflow_log_data log_data[] = { 
+                    { "text", response.recognition_result().transcript().c_str() },
+                    { "score", score.c_str() },
+                    { "offset", offset.c_str() }
+                };
+                df_log_call(user_data, "final_transcription", ARRAY_LEN(log_data), log_data);
+
+                struct dialogflow_event event = {};
+                event.type = DF_EVENT_FINAL_TRANSCRIPTION;
+                event.text = response.recognition_result().transcript().c_str();
+                event.confidence = response.recognition_result().confidence();
+                event.offset = offset_as_double;
+                df_emit_event(session, event);
+
+                session->transcript_stability = 1.0f;
+                lock.lock();
+                session->last_transcription_time = tvnow();
+                session->transcription_response = read;
+                stop_writes = session->stop_writes_on_final_transcription;
+                lock.unlock();
+                if (stop_writes) {
+                    maybe_stop_session_writes(session);
                 }
+            } else {
+                std::string stability = std::to_string(response.recognition_result().stability());
+                struct dialogflow_log_data log_data[] = { 
+                    { "text", response.recognition_result().transcript().c_str() },
+                    { "stability", stability.c_str() },
+                    { "offset", offset.c_str() }
+                };
+                df_log_call(user_data, "transcription", ARRAY_LEN(log_data), log_data);
+
+                struct dialogflow_event event = {};
+                event.type = DF_EVENT_TRANSCRIPTION;
+                event.text = response.recognition_result().transcript().c_str();
+                event.stability = response.recognition_result().stability();
+                event.offset = offset_as_double;
+                df_emit_event(session, event);
+
+                session->transcript_stability = response.recognition_result().stability();
+                lock.lock();
+                session->last_transcription_time = tvnow();
+                lock.unlock();
             }
-        } else if (response.output_audio().length() == 0) { /* don't complain if it's got an audio bit */
-            df_log(LOG_DEBUG, "Got unexpected response packet for %s\n", sessionId.c_str());
         }
-        if (response.output_audio().length() > 0) { /* but have this outside the if/else clause in case it comes on another packet */
-            df_log(LOG_DEBUG, "Got response with audio for %s\n", sessionId.c_str());
-            lock.lock();
-            session->audio_response = std::make_shared<StreamingDetectIntentResponse>(response);
-            lock.unlock();
-            df_log_call(user_data, "audio_data", 0, NULL);
-        } 
+    } else if (response.output_audio().length() == 0) { /* don't complain if it's got an audio bit */
+        df_log(LOG_DEBUG, "Got unexpected response packet for %s\n", sessionId.c_str());
     }
-    
-    make_streaming_responses(session);
-    lock.lock();
-    if (session->state != DF_STATE_ERROR) {
-        session->state = DF_STATE_FINISHED;
+    if (response.output_audio().length() > 0) { /* but have this outside the if/else clause in case it comes on another packet */
+        df_log(LOG_DEBUG, "Got response with audio for %s\n", sessionId.c_str());
+        lock.lock();
+        session->audio_response = read;
+        lock.unlock();
+        df_log_call(user_data, "audio_data", 0, NULL);
+        df_emit_output_audio(session, response.output_audio());
     }
-    
-    return;
 }
 
-int df_start_recognition(struct dialogflow_session *session, const char *language, int request_audio,
-    const char **hints, size_t hints_count)
+/* called on a completion queue thread once the server has finished the stream */
+static void df_read_done(struct dialogflow_session *session, const Status& status)
 {
+    make_streaming_responses(session);
     std::unique_lock<std::mutex> lock(session->lock);
-
-    if (session->state != DF_STATE_READY) {
-        lock.unlock();
-        df_stop_recognition(session);
-        lock.lock();
+    if (session->state != DF_STATE_ERROR) {
+        set_state_locked(session, DF_STATE_FINISHED);
     }
-
     lock.unlock();
-    ensure_connected(session);
-    lock.lock();
 
-    if (!is_session_connected(session)) {
-        session->results.clear();
-        session->results.push_back(std::unique_ptr<df_result>(new df_result("error", "Failed to connect", 100)));
-        return -1;
+    if (!status.ok()) {
+        df_emit_error_event(session, status);
     }
+    struct dialogflow_event event = {};
+    event.type = DF_EVENT_FINISHED;
+    df_emit_event(session, event);
+}
 
-    std::string session_path = format("projects/%s/agent/sessions/%s", session->project_id.c_str(), session->session_id.c_str());
-
-    df_log(LOG_DEBUG, "Session %s starting recognition to %s\n", session->session_id.c_str(), session_path.c_str());
+void df_stream_call_op::complete(bool ok)
+{
+    /* the call must outlive the handler even if the session lets go of it meanwhile */
+    std::shared_ptr<df_stream_call> reference(call->shared_from_this());
+    (call->*handler)(ok);
+    call->release_op();
+}
 
-    struct dialogflow_log_data log_data[] = {
-        { "language", cstr_or(language, "en") },
-        { "session_path", session_path.c_str() },
-        { "hints", hints, dialogflow_log_data_value_type_array_of_string, hints_count },
-        { "request_sentiment_analysis", session->request_sentiment_analysis ? "true" : "false" },
-        { "request_audio", request_audio ? "true" : "false" },
-        { "single_utterance", session->use_external_endpointer == false ? "true" : "false" },
-        { "model", session->model.c_str() }
-    };
-    lock.unlock();
-    df_log_call(session->user_data, "start", ARRAY_LEN(log_data), log_data);
-    lock.lock();
+static google::protobuf::ArenaOptions turn_arena_options()
+{
+    google::protobuf::ArenaOptions options;
+    /* most turns are a handful of small transcripts and a query result, output audio takes a block of its own */
+    options.start_block_size = 4096;
+    options.max_block_size = 65536;
+    return options;
+}
 
-    session->session_start_time = tvnow();
-    /* it didn't like assigning this to the session structure location */
-    session->context.reset(new ClientContext());
-    session->current_request = std::move(session->session->StreamingDetectIntent(session->context.get()));
+df_turn_memory::df_turn_memory() : responses(0), arena_bytes(0), allocations(0), arena(turn_arena_options())
+{
+}
 
-    StreamingDetectIntentRequest request;
-    request.set_session(session_path);
-    request.set_single_utterance(session->use_external_endpointer == false);
-    request.mutable_query_input()->mutable_audio_config()->set_audio_encoding(google::cloud::dialogflow::v2beta1::AUDIO_ENCODING_MULAW);
-    request.mutable_query_input()->mutable_audio_config()->set_sample_rate_hertz(8000);
-    request.mutable_query_input()->mutable_audio_config()->set_language_code(cstr_or(language, "en-US"));
-    if (!session->model.empty()) {
-        request.mutable_query_input()->mutable_audio_config()->set_model(session->model);
-    }
-    for (size_t i = 0; i < hints_count; i++) {
-        request.mutable_query_input()->mutable_audio_config()->add_phrase_hints(hints[i]);
-    }
-    if (request_audio) {
-        request.mutable_output_audio_config()->set_audio_encoding(google::cloud::dialogflow::v2beta1::OutputAudioEncoding::OUTPUT_AUDIO_ENCODING_LINEAR_16);
-        request.mutable_output_audio_config()->set_sample_rate_hertz(8000);
-    }
-    if (session->request_sentiment_analysis) {
-        request.mutable_query_params()->mutable_sentiment_analysis_request_config()->set_analyze_query_text_sentiment(1);
-    }
+StreamingDetectIntentResponse *df_turn_memory::new_response()
+{
+    return google::protobuf::Arena::CreateMessage<StreamingDetectIntentResponse>(&arena);
+}
 
-    if (!session->current_request->Write(request)) {
-        df_log(LOG_WARNING, "Session %s got error writing initial data packet to %s\n", session->session_id.c_str(), session->project_id.c_str());
-        session->state = DF_STATE_ERROR;
-        lock.unlock();
-        df_log_call(session->user_data, "write_error", 0, NULL); 
-        return -1;
-    }
-    if (session->debug) {
-        df_log(LOG_DEBUG, "REQUEST: %s\n", request.ShortDebugString().c_str());
+void df_turn_memory::response_read()
+{
+    size_t allocated = (size_t) arena.SpaceAllocated();
+    responses++;
+    if (allocated != arena_bytes) {
+        allocations++;
+        arena_bytes = allocated;
     }
-
-    session->state = DF_STATE_STARTED;
-    session->bytesWritten = 0;
-    session->packetsWritten = 1;
-    session->responsesReceived = 0;
-
-    session->read_thread = std::thread(df_read_exec, session);
-
-    return 0;
 }
 
-int df_stop_recognition(struct dialogflow_session *session)
+df_audio_ring::df_audio_ring(size_t capacity) : capacity(capacity), high_water(0), dropped_bytes(0), buffer(capacity), head(0), tail(0)
 {
-    std::unique_lock<std::mutex> lock(session->lock);
-    df_log(LOG_DEBUG, "Session %s stopping recognition to %s\n", session->session_id.c_str(), session->project_id.c_str());
+}
 
-    if (session->state != DF_STATE_READY) {
-        lock.unlock();
-        df_log_call(session->user_data, "stopping", 0, NULL);
-        maybe_stop_session_writes(session);
-        lock.lock();
+/* producer side - a frame that doesn't fit is dropped whole */
+bool df_audio_ring::write(const char *data, size_t length)
+{
+    size_t write_position = head.load(std::memory_order_relaxed);
+    size_t used = write_position - tail.load(std::memory_order_acquire);
 
-        if (session->read_thread.joinable()) {
-            lock.unlock();
-            session->read_thread.join();
-            lock.lock();
-        }
+    if (length > capacity - used) {
+        dropped_bytes.fetch_add(length, std::memory_order_relaxed);
+        return false;
+    }
 
-        if (session->state == DF_STATE_READY) {
-            /* while unlocked someone beat us to it */
-            return 0;
-        }
+    size_t offset = write_position % capacity;
+    size_t first = std::min(length, capacity - offset);
+    memcpy(&buffer[offset], data, first);
+    memcpy(&buffer[0], data + first, length - first);
+    head.store(write_position + length, std::memory_order_release);
 
-        Status status = session->current_request->Finish();
-        if (!status.ok()) {
-            df_log(LOG_WARNING, "Session %s got error performing streaming detection on %s: %s (%d: %s)\n", session->session_id.c_str(), session->project_id.c_str(),
-                status.error_message().c_str(), status.error_code(), status.error_details().c_str());
-            std::string error_code_string = std::to_string(status.error_code());
-            struct dialogflow_log_data log_data[] = {
-                { "message", status.error_message().c_str() },
-                { "details", status.error_details().c_str() }, 
-                { "error_code", error_code_string.c_str() }
-            };
-            lock.unlock();
-            df_log_call(session->user_data, "error", 3, log_data);
-            lock.lock();
-            session->results.clear();
-            session->results.push_back(std::unique_ptr<df_result>(new df_result("error", status.error_message(), 100)));
-            session->results.push_back(std::unique_ptr<df_result>(new df_result("error_details", status.error_details(), 100)));
-            session->results.push_back(std::unique_ptr<df_result>(new df_result("error_code", error_code_string, 100)));
-        }
-        lock.unlock();
-        df_log_call(session->user_data, "stop", 0, NULL);
-        lock.lock();
-        session->writes_done = false;
-        session->state = DF_STATE_READY;
+    if (used + length > high_water.load(std::memory_order_relaxed)) {
+        high_water.store(used + length, std::memory_order_relaxed);
     }
-    return 0;
+    return true;
 }
 
-enum dialogflow_session_state df_write_audio(struct dialogflow_session *session, const char *samples, size_t sample_count)
+/* consumer side */
+size_t df_audio_ring::read(std::string& destination, size_t max_length)
 {
-    std::unique_lock<std::mutex> lock(session->lock);
-    enum dialogflow_session_state state;
+    size_t read_position = tail.load(std::memory_order_relaxed);
+    size_t length = std::min(head.load(std::memory_order_acquire) - read_position, max_length);
 
-    state = session->state;
-    if (session->writes_done) {
-        if (session->debug) {
-            lock.unlock();
-            df_log(LOG_DEBUG, "Not writing audio because writes are done.\n");
-        }
-        return state;
-    }
-    lock.unlock();
-
-    if (state != DF_STATE_STARTED) {
-        return state;
-    }
+    size_t offset = read_position % capacity;
+    size_t first = std::min(length, capacity - offset);
+    destination.resize(length);
+    memcpy(&destination[0], &buffer[offset], first);
+    memcpy(&destination[first], &buffer[0], length - first);
+    tail.store(read_position + length, std::memory_order_release);
 
-    StreamingDetectIntentRequest request;
-    request.set_input_audio(samples, sample_count);
+    return length;
+}
 
-#ifdef DF_LOG_WRITES
-    static int logcount = 0;
-    if (++logcount % 50 == 1) {
-        df_log(LOG_DEBUG, "Session %s writing %d bytes audio...\n", session->session_id.c_str(),
-            (int) sample_count);
-    }
-#endif
+size_t df_audio_ring::read(char *destination, size_t max_length)
+{
+    size_t read_position = tail.load(std::memory_order_relaxed);
+    size_t length = std::min(head.load(std::memory_order_acquire) - read_position, max_length);
 
-    lock.lock();
-    if (!session->current_request->Write(request)) {
-        state = session->state = DF_STATE_ERROR;
-        lock.unlock();
-        df_log(LOG_WARNING, "Session %s got error writing audio data packet to %s\n", session->session_id.c_str(), session->project_id.c_str());
-        df_log_call(session->user_data, "write_error", 0, NULL); 
-    }
-    if (session->debug) {
-        lock.unlock();
-        df_log(LOG_DEBUG, "REQUEST: %s\n", request.ShortDebugString().c_str());
-    }
+    size_t offset = read_position % capacity;
+    size_t first = std::min(length, capacity - offset);
+    memcpy(destination, &buffer[offset], first);
+    memcpy(destination + first, &buffer[0], length - first);
+    tail.store(read_position + length, std::memory_order_release);
 
-    return state;
+    return length;
 }
 
-enum dialogflow_session_state df_get_state(struct dialogflow_session *session)
+size_t df_audio_ring::readable() const
 {
-    std::lock_guard<std::mutex> lock(session->lock);
-
-    return session->state;
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
 }
 
-int df_get_rpc_state(struct dialogflow_session *session)
+/* allocate a slice for an input_audio-only request and write the field's tag and length into it,
+   returning where the audio goes */
+static char *start_audio_packet(grpc_slice *slice, size_t length)
 {
-    std::lock_guard<std::mutex> lock(session->lock);
-
-    return int(session->channel->GetState(false));
+    using google::protobuf::io::CodedOutputStream;
+    /* field number plus the length-delimited wire type */
+    const uint32_t tag = (StreamingDetectIntentRequest::kInputAudioFieldNumber << 3) | 2;
+    size_t header_length = CodedOutputStream::VarintSize32(tag) + CodedOutputStream::VarintSize32(length);
+
+    *slice = grpc_slice_malloc(header_length + length);
+    uint8_t *header = GRPC_SLICE_START_PTR(*slice);
+    header = CodedOutputStream::WriteVarint32ToArray(tag, header);
+    header = CodedOutputStream::WriteVarint32ToArray(length, header);
+    return (char *) header;
 }
 
-int df_get_result_count(struct dialogflow_session *session)
+grpc::ByteBuffer df_encode_audio_packet(const char *samples, size_t length)
 {
-    std::lock_guard<std::mutex> lock(session->lock);
+    grpc_slice raw_slice;
+    memcpy(start_audio_packet(&raw_slice, length), samples, length);
+    grpc::Slice slice(raw_slice, grpc::Slice::STEAL_REF);
+    return grpc::ByteBuffer(&slice, 1);
+}
 
-    return session->results.size();
+df_stream_call::df_stream_call(struct dialogflow_session *session, std::shared_ptr<df_audio_ring> audio_ring) :
+    session(session),
+    audio_ring(audio_ring),
+    pre_roll_limit(0),
+    pre_roll_used(0),
+    stream_up(false),
+    cq(nullptr),
+    response(nullptr),
+    start_op(this, &df_stream_call::on_start),
+    read_op(this, &df_stream_call::on_read),
+    write_op(this, &df_stream_call::on_write),
+    writes_done_op(this, &df_stream_call::on_writes_done),
+    finish_op(this, &df_stream_call::on_finish),
+    coalesce_op(this, &df_stream_call::on_coalesce_timer),
+    coalesce_bytes(0),
+    coalesce_delay_ms(0),
+    coalesce_timer_set(false),
+    coalesce_due(false),
+    pending_ops(0),
+    started(false),
+    write_in_flight(false),
+    write_failed(false),
+    writes_done_requested(false),
+    writes_done_sent(false),
+    reads_done(false),
+    finish_started(false),
+    finished(false)
+{
 }
 
-struct dialogflow_result *df_get_result(struct dialogflow_session *session, int number)
+void df_stream_call::set_coalescing(size_t bytes, int max_delay_ms)
 {
-    std::lock_guard<std::mutex> lock(session->lock);
-    struct dialogflow_result *result = nullptr;
+    std::lock_guard<std::mutex> lock(this->lock);
+    coalesce_bytes = bytes;
+    coalesce_delay_ms = max_delay_ms;
+}
 
-    if (number >= 0 && number < int(session->results.size())) {
-        result = &(session->results[number]->result);
+/* with a raw_channel the call goes through a generic stub and audio is sent pre-encoded */
+void df_stream_call::start(Sessions::StubInterface *stub, std::shared_ptr<grpc::Channel> raw_channel, grpc::CompletionQueue *cq)
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    this->cq = cq;
+    this->raw_channel = raw_channel;
+    pending_ops++;
+    if (raw_channel != nullptr) {
+        grpc::GenericStub generic_stub(raw_channel);
+        raw_stream = generic_stub.PrepareCall(&context, DF_STREAMING_DETECT_INTENT_METHOD, cq);
+        raw_stream->StartCall(&start_op);
+    } else {
+        stream = stub->PrepareAsyncStreamingDetectIntent(&context, cq);
+        stream->StartCall(&start_op);
+    }
+}
+
+bool df_stream_call::write(std::unique_ptr<StreamingDetectIntentRequest> request)
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    if (write_failed || reads_done || writes_done_requested) {
+        return false;
+    }
+    df_outgoing_message message;
+    if (raw_stream != nullptr) {
+        bool own_buffer;
+        grpc::SerializationTraits<StreamingDetectIntentRequest>::Serialize(*request, &message.buffer, &own_buffer);
+    } else {
+        message.request = std::move(request);
+    }
+    write_queue.push_back(std::move(message));
+    pump_writes_locked();
+    return true;
+}
+
+/* add audio to the packet being built, sending it once it reaches the coalescing size */
+bool df_stream_call::write_audio(const char *samples, size_t length)
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    if (write_failed || reads_done || writes_done_requested) {
+        return false;
+    }
+    if (coalesce_bytes == 0) {
+        queue_audio_locked(samples, length);
+        pump_writes_locked();
+        return true;
+    }
+    coalesce_buffer.append(samples, length);
+    if (coalesce_buffer.size() >= coalesce_bytes) {
+        queue_coalesced_audio_locked();
+        pump_writes_locked();
+    } else {
+        arm_coalesce_timer_locked();
+    }
+    return true;
+}
+
+void df_stream_call::writes_done()
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    if (!coalesce_buffer.empty()) {
+        queue_coalesced_audio_locked();
+    }
+    if (coalesce_timer_set) {
+        coalesce_timer.Cancel();
+    }
+    writes_done_requested = true;
+    pump_writes_locked();
+}
+
+void df_stream_call::pump_writes()
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    pump_writes_locked();
+}
+
+/* whether the producer filling the ring should wake the sender - not while a write is outstanding, since
+   its completion drains the ring, nor while a coalescing timer is waiting for the ring to fill */
+bool df_stream_call::wants_ring_pump() const
+{
+    if (write_in_flight) {
+        return false;
+    }
+    return !coalesce_timer_set || audio_ring->readable() >= coalesce_bytes;
+}
+
+void df_stream_call::queue_audio_locked(const char *samples, size_t length)
+{
+    df_outgoing_message message;
+    if (raw_stream != nullptr) {
+        message.buffer = df_encode_audio_packet(samples, length);
+    } else {
+        message.request.reset(new StreamingDetectIntentRequest());
+        message.request->set_input_audio(samples, length);
+    }
+    write_queue.push_back(std::move(message));
+}
+
+/* send whatever has built up in the ring since the last write as one packet */
+void df_stream_call::queue_ring_audio_locked()
+{
+    df_outgoing_message message;
+    if (raw_stream != nullptr) {
+        grpc_slice raw_slice;
+        size_t length = std::min(audio_ring->readable(), (size_t) DF_MAX_AUDIO_PACKET);
+        audio_ring->read(start_audio_packet(&raw_slice, length), length);
+        grpc::Slice slice(raw_slice, grpc::Slice::STEAL_REF);
+        message.buffer = grpc::ByteBuffer(&slice, 1);
+    } else {
+        message.request.reset(new StreamingDetectIntentRequest());
+        audio_ring->read(*message.request->mutable_input_audio(), DF_MAX_AUDIO_PACKET);
+    }
+    write_queue.push_back(std::move(message));
+}
+
+void df_stream_call::queue_coalesced_audio_locked()
+{
+    if (raw_stream != nullptr) {
+        queue_audio_locked(coalesce_buffer.data(), coalesce_buffer.size());
+        coalesce_buffer.clear();
+        return;
+    }
+    df_outgoing_message message;
+    message.request.reset(new StreamingDetectIntentRequest());
+    message.request->mutable_input_audio()->swap(coalesce_buffer);
+    write_queue.push_back(std::move(message));
+}
+
+void df_stream_call::start_read_locked()
+{
+    pending_ops++;
+    response = turn_memory->new_response();
+    if (raw_stream != nullptr) {
+        raw_stream->Read(&response_buffer, &read_op);
+    } else {
+        stream->Read(response, &read_op);
+    }
+}
+
+/* bound how long a partly filled packet can wait for more audio */
+void df_stream_call::arm_coalesce_timer_locked()
+{
+    if (coalesce_timer_set || coalesce_delay_ms <= 0 || cq == nullptr || finish_started) {
+        return;
+    }
+    coalesce_timer_set = true;
+    pending_ops++;
+    coalesce_timer.Set(cq, std::chrono::system_clock::now() + std::chrono::milliseconds(coalesce_delay_ms), &coalesce_op);
+}
+
+bool df_stream_call::ring_ready_locked() const
+{
+    size_t readable = audio_ring->readable();
+    if (readable == 0) {
+        return false;
+    }
+    return readable >= coalesce_bytes || coalesce_due || writes_done_requested;
+}
+
+/* wait for everything queued so far to go out on the wire */
+bool df_stream_call::flush()
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    cond.wait(lock, [this] { return (write_queue.empty() && !write_in_flight) || write_failed || finish_started; });
+    return write_queue.empty() && !write_failed;
+}
+
+/* flow control holds back write completions, so the queue only drains as fast as the stream will take it */
+bool df_stream_call::wait_for_writes(size_t max_pending, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    auto has_room = [this, max_pending] {
+        return (write_queue.size() <= max_pending && (audio_ring == nullptr || audio_ring->readable() <= audio_ring->capacity / 2)) ||
+            write_failed || finish_started;
+    };
+    if (timeout_ms < 0) {
+        cond.wait(lock, has_room);
+    } else if (!cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), has_room)) {
+        return false;
+    }
+    return !write_failed && !finish_started;
+}
+
+/* wait for the server to finish the call and every outstanding operation to come back */
+Status df_stream_call::wait()
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    cond.wait(lock, [this] { return finished && pending_ops == 0; });
+    return status;
+}
+
+void df_stream_call::pump_writes_locked()
+{
+    if (!started || write_in_flight || writes_done_sent) {
+        return;
+    }
+    if (reads_done || write_failed) {
+        write_queue.clear();
+        return;
+    }
+    if (write_queue.empty() && audio_ring != nullptr) {
+        if (ring_ready_locked()) {
+            queue_ring_audio_locked();
+            coalesce_due = false;
+        } else if (audio_ring->readable() > 0) {
+            arm_coalesce_timer_locked();
+        }
+    }
+    if (!write_queue.empty()) {
+        write_in_flight = true;
+        pending_ops++;
+        if (raw_stream != nullptr) {
+            raw_stream->Write(write_queue.front().buffer, &write_op);
+        } else {
+            stream->Write(*write_queue.front().request, &write_op);
+        }
+    } else if (writes_done_requested) {
+        write_in_flight = true;
+        writes_done_sent = true;
+        pending_ops++;
+        if (raw_stream != nullptr) {
+            raw_stream->WritesDone(&writes_done_op);
+        } else {
+            stream->WritesDone(&writes_done_op);
+        }
+    }
+}
+
+void df_stream_call::maybe_finish_locked()
+{
+    if (reads_done && !write_in_flight && !finish_started) {
+        finish_started = true;
+        write_queue.clear();
+        if (coalesce_timer_set) {
+            coalesce_timer.Cancel();
+        }
+        pending_ops++;
+        if (raw_stream != nullptr) {
+            raw_stream->Finish(&status, &finish_op);
+        } else {
+            stream->Finish(&status, &finish_op);
+        }
+        cond.notify_all();
+    }
+}
+
+void df_stream_call::release_op()
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    bool done = (--pending_ops == 0 && finished);
+    if (done) {
+        cond.notify_all();
+    }
+    lock.unlock();
+
+    if (done) {
+        wake_reaper();
+    }
+}
+
+void df_stream_call::cancel()
+{
+    context.TryCancel();
+}
+
+bool df_stream_call::is_finished()
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    return finished && pending_ops == 0;
+}
+
+/* only called by the thread writing audio */
+bool df_stream_call::reserve_pre_roll(size_t length)
+{
+    if (pre_roll_limit == 0 || stream_up) {
+        return true;
+    }
+    if (pre_roll_used + length > pre_roll_limit) {
+        return false;
+    }
+    pre_roll_used += length;
+    return true;
+}
+
+void df_stream_call::on_start(bool ok)
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    started = true;
+    if (!ok) {
+        /* the call never got going, Finish will tell us why */
+        reads_done = true;
+        maybe_finish_locked();
+        return;
+    }
+    start_read_locked();
+    /* the configuration and any pre-roll go out first, in the order they were written */
+    pump_writes_locked();
+    stream_up = true;
+    lock.unlock();
+
+    std::unique_lock<std::mutex> session_lock(session->lock);
+    if (session->state != DF_STATE_STARTING || std::atomic_load(&session->current_request).get() != this) {
+        return;
+    }
+    set_state_locked(session, DF_STATE_STARTED);
+    std::string setup = std::to_string(tvdiff_ms(tvnow(), session->session_start_time));
+    std::string pre_roll = std::to_string(pre_roll_used);
+    session_lock.unlock();
+
+    df_log(LOG_DEBUG, "Session %s stream is up after %sms with %s bytes of pre-roll\n", session->session_id.c_str(), setup.c_str(), pre_roll.c_str());
+    struct dialogflow_log_data log_data[] = {
+        { "setup_ms", setup.c_str() },
+        { "pre_roll_bytes", pre_roll.c_str() }
+    };
+    df_log_call(session->user_data, "stream_started", ARRAY_LEN(log_data), log_data);
+}
+
+void df_stream_call::on_read(bool ok)
+{
+    if (ok) {
+        /* shares ownership of the arena rather than copying out of it */
+        std::shared_ptr<StreamingDetectIntentResponse> read(turn_memory, response);
+        if (raw_stream == nullptr) {
+            turn_memory->response_read();
+            df_read_response(session, read);
+        } else if (grpc::SerializationTraits<StreamingDetectIntentResponse>::Deserialize(&response_buffer, response).ok()) {
+            turn_memory->response_read();
+            df_read_response(session, read);
+        } else {
+            df_log(LOG_WARNING, "Session %s got a response that failed to parse\n", session->session_id.c_str());
+        }
+        std::lock_guard<std::mutex> lock(this->lock);
+        start_read_locked();
+    } else {
+        std::lock_guard<std::mutex> lock(this->lock);
+        reads_done = true;
+        maybe_finish_locked();
+    }
+}
+
+void df_stream_call::on_write(bool ok)
+{
+    std::unique_lock<std::mutex> lock(this->lock);
+    write_in_flight = false;
+    /* pairs with the producer's fence: either it sees the write done and pumps, or the pump below sees its audio */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    write_queue.pop_front();
+    if (!ok) {
+        write_failed = true;
+        write_queue.clear();
+    }
+    pump_writes_locked();
+    maybe_finish_locked();
+    cond.notify_all();
+    lock.unlock();
+
+    if (!ok) {
+        std::unique_lock<std::mutex> session_lock(session->lock);
+        bool was_started = (session->state == DF_STATE_STARTED || session->state == DF_STATE_STARTING);
+        if (was_started) {
+            set_state_locked(session, DF_STATE_ERROR);
+        }
+        session_lock.unlock();
+        if (was_started) {
+            df_log(LOG_WARNING, "Session %s got error writing audio data packet to %s\n", session->session_id.c_str(), session->project_id.c_str());
+            df_log_call(session->user_data, "write_error", 0, NULL);
+
+            struct dialogflow_event event = {};
+            event.type = DF_EVENT_ERROR;
+            event.text = "write error";
+            event.error_code = grpc::StatusCode::UNAVAILABLE;
+            df_emit_event(session, event);
+        }
+    }
+}
+
+void df_stream_call::on_writes_done(bool ok)
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    write_in_flight = false;
+    maybe_finish_locked();
+    cond.notify_all();
+}
+
+void df_stream_call::on_coalesce_timer(bool ok)
+{
+    std::lock_guard<std::mutex> lock(this->lock);
+    coalesce_timer_set = false;
+    /* as in on_write, ordered before the pump reads the ring */
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!ok) {
+        /* cancelled, whoever cancelled it has dealt with the pending audio */
+        return;
+    }
+    if (!coalesce_buffer.empty() && !writes_done_requested) {
+        queue_coalesced_audio_locked();
+    }
+    coalesce_due = true;
+    pump_writes_locked();
+    cond.notify_all();
+}
+
+void df_stream_call::on_finish(bool ok)
+{
+    df_read_done(session, status);
+    std::lock_guard<std::mutex> lock(this->lock);
+    finished = true;
+}
+
+/* how audio already in the given input encoding is described as a source for conversion */
+static enum dialogflow_source_audio_format source_format_for(enum dialogflow_audio_encoding encoding)
+{
+    switch (encoding) {
+    case DF_AUDIO_ENCODING_MULAW:
+        return DF_SOURCE_AUDIO_MULAW;
+    case DF_AUDIO_ENCODING_LINEAR_16:
+        return DF_SOURCE_AUDIO_SLIN;
+    default:
+        return DF_SOURCE_AUDIO_NATIVE;
+    }
+}
+
+/* opus only runs at a few rates, anything else is resampled to wideband */
+static int opus_sample_rate(int sample_rate)
+{
+    switch (sample_rate) {
+    case 8000:
+    case 12000:
+    case 16000:
+    case 24000:
+    case 48000:
+        return sample_rate;
+    default:
+        return 16000;
+    }
+}
+
+int df_start_recognition(struct dialogflow_session *session, const char *language, int request_audio,
+    const char **hints, size_t hints_count)
+{
+    if (refuse_on_completion_thread(session, "start recognition")) {
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lock(session->lock);
+
+    if (session->closing) {
+        df_log(LOG_WARNING, "Session %s is closing, not starting recognition\n", session->session_id.c_str());
+        return -1;
+    }
+
+    wait_for_event_call(session, lock);
+
+    if (session->state != DF_STATE_READY) {
+        lock.unlock();
+        df_stop_recognition(session);
+        lock.lock();
+    }
+
+    lock.unlock();
+    log_pending_results(session);
+    ensure_connected(session);
+    lock.lock();
+
+    if (!is_session_connected(session)) {
+        clear_results(session);
+        session->results.add("error", "Failed to connect", 100);
+        return -1;
+    }
+
+    /* the gate and endpointer listen to audio as it's written, before it's converted */
+    enum dialogflow_source_audio_format written_format = session->source_format;
+    int written_sample_rate = session->source_sample_rate;
+    if (written_format == DF_SOURCE_AUDIO_NATIVE) {
+        written_format = source_format_for(session->input_encoding);
+        written_sample_rate = session->input_sample_rate;
+    }
+    bool can_detect_speech = df_speech_detector::supports(written_format);
+
+    std::unique_ptr<df_voice_gate> gate;
+    if (session->voice_gate_threshold != 0) {
+        if (can_detect_speech) {
+            gate.reset(new df_voice_gate(written_format, written_sample_rate, session->voice_gate_threshold,
+                session->voice_gate_pre_roll_ms, session->voice_gate_trailing_ms));
+        } else {
+            df_log(LOG_WARNING, "Session %s can't listen for speech in audio encoding %d, sending all of it\n", session->session_id.c_str(), (int) session->input_encoding);
+        }
+    }
+
+    std::unique_ptr<df_endpointer> endpointer;
+    if (session->endpointer_threshold != 0 && session->use_external_endpointer) {
+        if (can_detect_speech) {
+            endpointer.reset(new df_endpointer(written_format, written_sample_rate, session->endpointer_threshold,
+                session->endpointer_hangover_ms, session->endpointer_min_stability));
+        } else {
+            df_log(LOG_WARNING, "Session %s can't listen for the end of speech in audio encoding %d\n", session->session_id.c_str(), (int) session->input_encoding);
+        }
+    }
+
+    /* what df_write_audio will be given, and what goes out on the stream */
+    enum dialogflow_source_audio_format source_format = session->source_format;
+    int source_sample_rate = session->source_sample_rate;
+    enum dialogflow_audio_encoding stream_encoding = session->input_encoding;
+    int stream_sample_rate = session->input_sample_rate;
+    if (session->opus_bitrate > 0) {
+        if (source_format == DF_SOURCE_AUDIO_NATIVE) {
+            source_format = source_format_for(stream_encoding);
+            source_sample_rate = stream_sample_rate;
+        }
+        if (source_format == DF_SOURCE_AUDIO_NATIVE) {
+            /* left as it is, the audio would go out labelled as opus */
+            df_log(LOG_WARNING, "Session %s can't compress audio encoding %d to opus\n", session->session_id.c_str(), (int) stream_encoding);
+            clear_results(session);
+            session->results.add("error", "Unsupported audio conversion", 100);
+            return -1;
+        }
+        stream_encoding = DF_AUDIO_ENCODING_OGG_OPUS;
+        stream_sample_rate = opus_sample_rate(stream_sample_rate);
+    }
+
+    std::unique_ptr<df_audio_converter> converter;
+    if (source_format != DF_SOURCE_AUDIO_NATIVE) {
+        if (df_audio_converter::supports(source_format, stream_encoding)) {
+            converter.reset(new df_audio_converter(source_format, source_sample_rate, stream_encoding, stream_sample_rate, session->opus_bitrate));
+        }
+        if (converter == nullptr || !converter->ok()) {
+            df_log(LOG_WARNING, "Session %s can't convert source audio format %d to audio encoding %d\n", session->session_id.c_str(),
+                (int) source_format, (int) stream_encoding);
+            clear_results(session);
+            session->results.add("error", "Unsupported audio conversion", 100);
+            return -1;
+        }
+    }
+
+    /* only once nothing above can fail, the stream counts against the shard until df_stop_recognition */
+    if (session->channel_group != nullptr) {
+        std::shared_ptr<df_channel_shard> shard = select_channel_shard(*session->channel_group, session->session_id, true);
+        session->stream_shard = shard;
+        if (shard != session->channel_shard) {
+            df_log(LOG_DEBUG, "Session %s moving to a less loaded channel to %s\n", session->session_id.c_str(), session->endpoint.c_str());
+            session->channel_shard = shard;
+            session->channel = shard->channel;
+            session->session = std::move(Sessions::NewStub(session->channel));
+        }
+    }
+
+    std::string session_path = format("projects/%s/agent/sessions/%s", session->project_id.c_str(), session->session_id.c_str());
+
+    df_log(LOG_DEBUG, "Session %s starting recognition to %s\n", session->session_id.c_str(), session_path.c_str());
+
+    std::string encoding_name = google::cloud::dialogflow::v2beta1::AudioEncoding_Name(google::cloud::dialogflow::v2beta1::AudioEncoding(stream_encoding));
+    std::string sample_rate = std::to_string(stream_sample_rate);
+    struct dialogflow_log_data log_data[] = {
+        { "language", cstr_or(language, "en") },
+        { "session_path", session_path.c_str() },
+        { "audio_encoding", encoding_name.c_str() },
+        { "sample_rate", sample_rate.c_str() },
+        { "hints", hints, dialogflow_log_data_value_type_array_of_string, hints_count },
+        { "request_sentiment_analysis", session->request_sentiment_analysis ? "true" : "false" },
+        { "request_audio", request_audio ? "true" : "false" },
+        { "single_utterance", session->use_external_endpointer == false ? "true" : "false" },
+        { "model", session->model.c_str() }
+    };
+    lock.unlock();
+    df_log_call(session->user_data, "start", ARRAY_LEN(log_data), log_data);
+    lock.lock();
+
+    session->session_start_time = tvnow();
+    session->audio_ring = nullptr;
+    if (session->audio_ring_size > 0) {
+        session->audio_ring = std::make_shared<df_audio_ring>(session->audio_ring_size);
+    }
+    std::shared_ptr<df_stream_call> call = std::make_shared<df_stream_call>(session, session->audio_ring);
+    call->set_coalescing(session->coalesce_bytes, session->coalesce_delay_ms);
+    call->set_converter(std::move(converter));
+    call->set_voice_gate(std::move(gate));
+    call->set_endpointer(std::move(endpointer));
+    call->set_pre_roll(session->start_pre_roll);
+    /* the last recognition's responses go with the last of the references to its arena */
+    session->turn_memory = std::make_shared<df_turn_memory>();
+    session->final_response.reset();
+    session->transcription_response.reset();
+    session->audio_response.reset();
+    call->set_turn_memory(session->turn_memory);
+    call->start(session->session.get(), session->raw_audio_writes ? session->channel : nullptr, get_completion_queue());
+    std::atomic_store(&session->current_request, call);
+
+    std::unique_ptr<StreamingDetectIntentRequest> request(new StreamingDetectIntentRequest());
+    request->set_session(session_path);
+    request->set_single_utterance(session->use_external_endpointer == false);
+    request->mutable_query_input()->mutable_audio_config()->set_audio_encoding(google::cloud::dialogflow::v2beta1::AudioEncoding(stream_encoding));
+    request->mutable_query_input()->mutable_audio_config()->set_sample_rate_hertz(stream_sample_rate);
+    request->mutable_query_input()->mutable_audio_config()->set_language_code(cstr_or(language, "en-US"));
+    if (!session->model.empty()) {
+        request->mutable_query_input()->mutable_audio_config()->set_model(session->model);
+    }
+    for (size_t i = 0; i < hints_count; i++) {
+        request->mutable_query_input()->mutable_audio_config()->add_phrase_hints(hints[i]);
+    }
+    if (request_audio) {
+        request->mutable_output_audio_config()->set_audio_encoding(google::cloud::dialogflow::v2beta1::OutputAudioEncoding::OUTPUT_AUDIO_ENCODING_LINEAR_16);
+        request->mutable_output_audio_config()->set_sample_rate_hertz(8000);
+    }
+    if (session->request_sentiment_analysis) {
+        request->mutable_query_params()->mutable_sentiment_analysis_request_config()->set_analyze_query_text_sentiment(1);
+    }
+    if (session->debug) {
+        df_log(LOG_DEBUG, "REQUEST: %s\n", request->ShortDebugString().c_str());
+    }
+
+    session->bytesWritten = 0;
+    session->sourceBytesWritten = 0;
+    session->suppressedBytes = 0;
+    session->suppressedSeconds = 0;
+    session->transcript_stability = 0;
+    session->last_speech_time = timeval{ 0, 0 };
+    session->end_of_speech_latency = -1;
+    session->preRollDroppedBytes = 0;
+    session->packetsWritten = 1;
+    session->responsesReceived = 0;
+
+    /* df_write_audio doesn't take the lock, so the configuration must be queued before the state says audio can follow */
+    call->write(std::move(request));
+    if (session->start_pre_roll > 0) {
+        /* the call moves to started once the stream is up, which can't happen before the lock is let go */
+        set_state_locked(session, DF_STATE_STARTING);
+        return 0;
+    }
+    set_state_locked(session, DF_STATE_STARTED);
+
+    /* the session can't stay locked while the initial packet goes out, the completion threads need it */
+    lock.unlock();
+    bool written = call->flush();
+    lock.lock();
+
+    if (!written) {
+        df_log(LOG_WARNING, "Session %s got error writing initial data packet to %s\n", session->session_id.c_str(), session->project_id.c_str());
+        if (session->state == DF_STATE_STARTED) {
+            set_state_locked(session, DF_STATE_ERROR);
+        }
+        lock.unlock();
+        df_log_call(session->user_data, "write_error", 0, NULL); 
+        return -1;
+    }
+
+    return 0;
+}
+
+int df_stop_recognition(struct dialogflow_session *session)
+{
+    if (refuse_on_completion_thread(session, "stop recognition")) {
+        return -1;
+    }
+
+    std::unique_lock<std::mutex> lock(session->lock);
+    df_log(LOG_DEBUG, "Session %s stopping recognition to %s\n", session->session_id.c_str(), session->project_id.c_str());
+
+    if (session->state != DF_STATE_READY) {
+        lock.unlock();
+        df_log_call(session->user_data, "stopping", 0, NULL);
+        maybe_stop_session_writes(session);
+        lock.lock();
+
+        std::shared_ptr<df_stream_call> call(session->current_request);
+        lock.unlock();
+        Status status = call->wait();
+        lock.lock();
+
+        if (session->state == DF_STATE_READY) {
+            /* while unlocked someone beat us to it */
+            return 0;
+        }
+
+        if (session->stream_shard != nullptr) {
+            session->stream_shard->active_streams--;
+            session->stream_shard = nullptr;
+        }
+        if (!status.ok()) {
+            df_log(LOG_WARNING, "Session %s got error performing streaming detection on %s: %s (%d: %s)\n", session->session_id.c_str(), session->project_id.c_str(),
+                status.error_message().c_str(), status.error_code(), status.error_details().c_str());
+            std::string error_code_string = std::to_string(status.error_code());
+            std::string error_message = status.error_message();
+            std::string error_details = status.error_details();
+            struct dialogflow_log_data log_data[] = {
+                { "message", error_message.c_str() },
+                { "details", error_details.c_str() }, 
+                { "error_code", error_code_string.c_str() }
+            };
+            lock.unlock();
+            log_pending_results(session);
+            df_log_call(session->user_data, "error", 3, log_data);
+            lock.lock();
+            clear_results(session);
+            session->results.add("error", error_message, 100);
+            session->results.add("error_details", error_details, 100);
+            session->results.add("error_code", error_code_string, 100);
+        }
+        std::string bytes_written = std::to_string(session->bytesWritten);
+        std::string source_bytes_written = std::to_string(session->sourceBytesWritten);
+        std::string suppressed_bytes = std::to_string(session->suppressedBytes);
+        std::string response_bytes = std::to_string(session->turn_memory->arena_bytes);
+        std::string response_allocations = std::to_string(session->turn_memory->allocations);
+        struct dialogflow_log_data stop_log_data[] = {
+            { "bytes_written", bytes_written.c_str() },
+            { "source_bytes_written", source_bytes_written.c_str() },
+            { "suppressed_bytes", suppressed_bytes.c_str() },
+            { "response_bytes", response_bytes.c_str() },
+            { "response_allocations", response_allocations.c_str() }
+        };
+        lock.unlock();
+        log_pending_results(session);
+        df_log_call(session->user_data, "stop", ARRAY_LEN(stop_log_data), stop_log_data);
+        lock.lock();
+        session->writes_done = false;
+        std::atomic_store(&session->current_request, std::shared_ptr<df_stream_call>());
+        set_state_locked(session, DF_STATE_READY);
+    } else {
+        /* an event's results */
+        lock.unlock();
+        log_pending_results(session);
+    }
+    return 0;
+}
+
+int df_close_session_async(struct dialogflow_session *session)
+{
+    std::unique_lock<std::mutex> lock(session->lock);
+    df_log(LOG_DEBUG, "Session %s closing in the background\n", session->session_id.c_str());
+    session->closing = true;
+    if (session->current_event_call != nullptr) {
+        session->current_event_call->cancel();
+    }
+    bool streaming = session->current_request != nullptr;
+    lock.unlock();
+
+    if (streaming) {
+        /* let the server finish with the audio it has, the reaper does the rest */
+        maybe_stop_session_writes(session);
+    }
+
+    std::lock_guard<std::mutex> reaper(reaper_lock);
+    if (!reaper_running) {
+        reaper_running = true;
+        reaper_thread = std::thread(df_reaper_exec);
+    }
+    df_reaper_entry entry = { session, std::chrono::steady_clock::now() + std::chrono::milliseconds(reaper_timeout_ms), false };
+    reaper_sessions.push_back(entry);
+    reaper_cond.notify_one();
+
+    return 0;
+}
+
+int df_set_async_close_timeout(int timeout_ms)
+{
+    std::lock_guard<std::mutex> lock(reaper_lock);
+    reaper_timeout_ms = timeout_ms;
+    return 0;
+}
+
+static void send_converted_audio(struct dialogflow_session *session, df_stream_call *call, const char *samples, size_t sample_count, bool debug);
+
+/* passes audio through the gate and converter, then on to the stream however the call sends it */
+static void send_session_audio(struct dialogflow_session *session, df_stream_call *call, const char *samples, size_t sample_count, bool debug)
+{
+    if (df_voice_gate *gate = call->voice_gate()) {
+        const std::string& speech = gate->process(samples, sample_count);
+        session->suppressedBytes = gate->suppressed_bytes();
+        session->suppressedSeconds = gate->suppressed_seconds();
+        if (speech.empty()) {
+            return;
+        }
+        samples = speech.data();
+        sample_count = speech.size();
+    }
+    if (df_audio_converter *converter = call->converter()) {
+        std::lock_guard<std::mutex> converting(call->conversion_lock);
+        const std::string& converted = converter->convert(samples, sample_count);
+        if (converted.empty()) {
+            /* nothing complete to send yet - half a sample, resampling down, or less than an opus frame */
+            return;
+        }
+        send_converted_audio(session, call, converted.data(), converted.size(), debug);
+        return;
+    }
+    send_converted_audio(session, call, samples, sample_count, debug);
+}
+
+/* the end of the audio the converter held back, sent ahead of writes_done */
+static void flush_converted_audio(struct dialogflow_session *session, df_stream_call *call)
+{
+    if (df_audio_converter *converter = call->converter()) {
+        std::lock_guard<std::mutex> converting(call->conversion_lock);
+        const std::string& converted = converter->finish();
+        if (!converted.empty()) {
+            send_converted_audio(session, call, converted.data(), converted.size(), session->debug);
+        }
+    }
+}
+
+static void send_converted_audio(struct dialogflow_session *session, df_stream_call *call, const char *samples, size_t sample_count, bool debug)
+{
+    session->bytesWritten += sample_count;
+    session->packetsWritten++;
+
+    df_audio_ring *audio_ring = call->ring();
+    if (audio_ring != nullptr) {
+        if (!audio_ring->write(samples, sample_count) && debug) {
+            df_log(LOG_DEBUG, "Session %s audio ring is full, dropping %d bytes\n", session->session_id.c_str(), (int) sample_count);
+        }
+        /* a sender that's mid-write picks the audio up when the write completes. the fence orders
+           the ring update before the check against the sender clearing write_in_flight then reading the ring */
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (call->wants_ring_pump()) {
+            call->pump_writes();
+        }
+        return;
+    }
+
+    /* coalesced and raw audio is packaged by the call itself */
+    if (call->packages_audio()) {
+        call->write_audio(samples, sample_count);
+        return;
+    }
+
+    std::unique_ptr<StreamingDetectIntentRequest> request(new StreamingDetectIntentRequest());
+    request->set_input_audio(samples, sample_count);
+
+#ifdef DF_LOG_WRITES
+    static int logcount = 0;
+    if (++logcount % 50 == 1) {
+        df_log(LOG_DEBUG, "Session %s writing %d bytes audio...\n", session->session_id.c_str(),
+            (int) sample_count);
+    }
+#endif
+
+    if (debug) {
+        df_log(LOG_DEBUG, "REQUEST: %s\n", request->ShortDebugString().c_str());
+    }
+    /* write failures come back on the completion queue and move the session to the error state */
+    call->write(std::move(request));
+}
+
+enum dialogflow_session_state df_write_audio(struct dialogflow_session *session, const char *samples, size_t sample_count)
+{
+    enum dialogflow_session_state state = session->state;
+    bool debug = session->debug;
+
+    if (session->closing) {
+        return DF_STATE_FINISHED;
+    }
+    if (session->writes_done) {
+        if (debug) {
+            df_log(LOG_DEBUG, "Not writing audio because writes are done.\n");
+        }
+        return state;
+    }
+    if (state != DF_STATE_STARTED && state != DF_STATE_STARTING) {
+        return state;
+    }
+
+    std::shared_ptr<df_stream_call> call(std::atomic_load(&session->current_request));
+    if (call == nullptr) {
+        return state;
+    }
+
+    session->sourceBytesWritten += sample_count;
+    /* dropped before the gate and converter see it, so what does go out still makes a continuous stream */
+    if (!call->reserve_pre_roll(sample_count)) {
+        if (debug) {
+            df_log(LOG_DEBUG, "Session %s start pre-roll is full, dropping %d bytes\n", session->session_id.c_str(), (int) sample_count);
+        }
+        session->preRollDroppedBytes += sample_count;
+        return state;
+    }
+    bool end_of_speech = false;
+    if (df_endpointer *endpointer = call->endpointer()) {
+        end_of_speech = endpointer->process(samples, sample_count, session->transcript_stability);
+        if (endpointer->heard_speech()) {
+            session->last_speech_time = tvnow();
+        }
+    }
+
+    send_session_audio(session, call.get(), samples, sample_count, debug);
+
+    if (end_of_speech) {
+        df_log(LOG_DEBUG, "Session %s heard the end of speech\n", session->session_id.c_str());
+        maybe_stop_session_writes(session);
+    }
+
+    return state;
+}
+
+int df_wait_for_writes(struct dialogflow_session *session, size_t max_pending, int timeout_ms)
+{
+    enum dialogflow_session_state state = session->state;
+    if (state != DF_STATE_STARTED && state != DF_STATE_STARTING) {
+        return -1;
+    }
+    std::shared_ptr<df_stream_call> call(std::atomic_load(&session->current_request));
+    if (call == nullptr || !call->wait_for_writes(max_pending, timeout_ms)) {
+        return -1;
+    }
+    return 0;
+}
+
+int df_set_input_audio_format(struct dialogflow_session *session, enum dialogflow_audio_encoding encoding, int sample_rate_hertz)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (!google::cloud::dialogflow::v2beta1::AudioEncoding_IsValid(encoding) || encoding == 0 || sample_rate_hertz <= 0) {
+        df_log(LOG_WARNING, "Session %s can't use audio encoding %d at %d Hz\n", session->session_id.c_str(), (int) encoding, sample_rate_hertz);
+        return -1;
+    }
+    session->input_encoding = encoding;
+    session->input_sample_rate = sample_rate_hertz;
+    return 0;
+}
+
+int df_set_source_audio_format(struct dialogflow_session *session, enum dialogflow_source_audio_format format, int sample_rate_hertz)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (format < DF_SOURCE_AUDIO_NATIVE || format > DF_SOURCE_AUDIO_SLIN || sample_rate_hertz <= 0) {
+        df_log(LOG_WARNING, "Session %s can't convert from source audio format %d at %d Hz\n", session->session_id.c_str(), (int) format, sample_rate_hertz);
+        return -1;
+    }
+    session->source_format = format;
+    session->source_sample_rate = sample_rate_hertz;
+    return 0;
+}
+
+int df_set_output_audio_format(struct dialogflow_session *session, enum dialogflow_output_audio_format format)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (format < DF_OUTPUT_AUDIO_AS_SENT || format > DF_OUTPUT_AUDIO_ALAW) {
+        df_log(LOG_WARNING, "Session %s can't convert output audio to format %d\n", session->session_id.c_str(), (int) format);
+        return -1;
+    }
+    session->output_audio_format = format;
+    return 0;
+}
+
+int df_set_opus_compression(struct dialogflow_session *session, int bitrate)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (bitrate < 0 || (bitrate > 0 && !df_audio_converter::supports(DF_SOURCE_AUDIO_SLIN, DF_AUDIO_ENCODING_OGG_OPUS))) {
+        df_log(LOG_WARNING, "Session %s can't compress audio to opus at %d bits per second\n", session->session_id.c_str(), bitrate);
+        return -1;
+    }
+    session->opus_bitrate = bitrate;
+    return 0;
+}
+
+int df_set_voice_gate(struct dialogflow_session *session, int threshold_dbfs, int pre_roll_ms, int trailing_silence_ms)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (threshold_dbfs > 0 || pre_roll_ms < 0 || trailing_silence_ms < 0) {
+        df_log(LOG_WARNING, "Session %s can't gate audio at %d dBFS with %dms pre-roll and %dms trailing silence\n", session->session_id.c_str(),
+            threshold_dbfs, pre_roll_ms, trailing_silence_ms);
+        return -1;
+    }
+    session->voice_gate_threshold = threshold_dbfs;
+    session->voice_gate_pre_roll_ms = pre_roll_ms;
+    session->voice_gate_trailing_ms = trailing_silence_ms;
+    return 0;
+}
+
+int df_set_local_endpointer(struct dialogflow_session *session, int threshold_dbfs, int hangover_ms, float min_stability)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (threshold_dbfs > 0 || hangover_ms < 0 || min_stability < 0 || min_stability > 1) {
+        df_log(LOG_WARNING, "Session %s can't listen for the end of speech at %d dBFS with %dms hangover and %f stability\n", session->session_id.c_str(),
+            threshold_dbfs, hangover_ms, min_stability);
+        return -1;
+    }
+    session->endpointer_threshold = threshold_dbfs;
+    session->endpointer_hangover_ms = hangover_ms;
+    session->endpointer_min_stability = min_stability;
+    return 0;
+}
+
+int df_set_start_pre_roll(struct dialogflow_session *session, size_t max_bytes)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    session->start_pre_roll = max_bytes;
+    return 0;
+}
+
+int df_set_audio_coalescing(struct dialogflow_session *session, size_t bytes, int max_delay_ms)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    session->coalesce_bytes = bytes;
+    session->coalesce_delay_ms = max_delay_ms;
+    return 0;
+}
+
+int df_set_raw_audio_writes(struct dialogflow_session *session, int raw_audio_writes)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    session->raw_audio_writes = raw_audio_writes != 0;
+    return 0;
+}
+
+int df_set_audio_ring_size(struct dialogflow_session *session, size_t ring_size)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    session->audio_ring_size = ring_size;
+    return 0;
+}
+
+size_t df_get_audio_ring_high_water(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    return session->audio_ring ? session->audio_ring->high_water.load() : 0;
+}
+
+size_t df_get_audio_dropped_bytes(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    return session->audio_ring ? session->audio_ring->dropped_bytes.load() : 0;
+}
+
+enum dialogflow_session_state df_get_state(struct dialogflow_session *session)
+{
+    return session->state;
+}
+
+int df_get_rpc_state(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+
+    return int(session->channel->GetState(false));
+}
+
+int df_get_result_count(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+
+    flatten_results(session);
+    return session->results.size();
+}
+
+struct dialogflow_result *df_get_result(struct dialogflow_session *session, int number)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    struct dialogflow_result *result = nullptr;
+
+    /* only as far as the part holding it */
+    while (number >= int(session->results.size()) && flatten_next_result_part(session)) {
+    }
+    if (number >= 0 && number < int(session->results.size())) {
+        result = session->results.get(number);
     }
 
     return result;
 }
 
-int df_get_response_count(struct dialogflow_session *session)
+struct dialogflow_result *df_get_result_by_name(struct dialogflow_session *session, const char *name)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    int index = -1;
+
+    /* the parts are added in order, so a name found in those flattened so far is the first of its name */
+    if (name != nullptr) {
+        while ((index = session->results.find(name)) < 0 && flatten_next_result_part(session)) {
+        }
+    }
+    return index < 0 ? nullptr : session->results.get(index);
+}
+
+struct dialogflow_result *df_get_next_result_with_prefix(struct dialogflow_session *session, const char *prefix, int *position)
 {
     std::lock_guard<std::mutex> lock(session->lock);
+    int index = -1;
+
+    if (prefix != nullptr && position != nullptr && *position >= 0) {
+        flatten_results(session);
+        index = session->results.find_prefix(prefix, *position);
+    }
+    if (index < 0) {
+        return nullptr;
+    }
+    *position = index + 1;
+    return session->results.get(index);
+}
+
+int df_get_response_count(struct dialogflow_session *session)
+{
     return session->responsesReceived;
 }
 
+size_t df_get_bytes_written(struct dialogflow_session *session)
+{
+    return session->bytesWritten;
+}
+
+size_t df_get_packets_written(struct dialogflow_session *session)
+{
+    return session->packetsWritten;
+}
+
+size_t df_get_source_bytes_written(struct dialogflow_session *session)
+{
+    return session->sourceBytesWritten;
+}
+
+int df_get_final_response(struct dialogflow_session *session, const char **data, size_t *length)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    df_result_source& source = session->result_source;
+
+    if (source.response == nullptr || data == nullptr || length == nullptr) {
+        return -1;
+    }
+    if (!source.have_response_bytes) {
+        source.response->SerializeToString(&source.response_bytes);
+        source.have_response_bytes = true;
+    }
+    *data = source.response_bytes.data();
+    *length = source.response_bytes.length();
+    return 0;
+}
+
+int df_get_final_response_json(struct dialogflow_session *session, const char **json, size_t *length)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    df_result_source& source = session->result_source;
+
+    if (source.response == nullptr || json == nullptr || length == nullptr) {
+        return -1;
+    }
+    if (!source.have_response_json) {
+        /* the default options are the canonical mapping */
+        auto status = google::protobuf::util::MessageToJsonString(*source.response, &source.response_json);
+        if (!status.ok()) {
+            df_log(LOG_WARNING, "Session %s couldn't turn its final response into JSON: %s\n", session->session_id.c_str(), status.ToString().c_str());
+            source.response_json.clear();
+            return -1;
+        }
+        source.have_response_json = true;
+    }
+    *json = source.response_json.c_str();
+    *length = source.response_json.length();
+    return 0;
+}
+
+int df_get_output_audio(struct dialogflow_session *session, struct dialogflow_output_audio *audio)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    if (session->output_audio == nullptr) {
+        return -1;
+    }
+    audio->data = session->output_audio->data();
+    audio->length = session->output_audio->length();
+    if (!df_parse_wav(audio->data, audio->length, audio)) {
+        /* no header to skip, so the whole thing is samples */
+        audio->samples_length = audio->length;
+    }
+    return 0;
+}
+
+size_t df_get_response_bytes(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    return session->turn_memory != nullptr ? session->turn_memory->arena_bytes.load() : 0;
+}
+
+size_t df_get_response_allocations(struct dialogflow_session *session)
+{
+    std::lock_guard<std::mutex> lock(session->lock);
+    return session->turn_memory != nullptr ? session->turn_memory->allocations.load() : 0;
+}
+
+size_t df_get_pre_roll_dropped_bytes(struct dialogflow_session *session)
+{
+    return session->preRollDroppedBytes;
+}
+
+size_t df_get_suppressed_bytes(struct dialogflow_session *session)
+{
+    return session->suppressedBytes;
+}
+
+double df_get_suppressed_seconds(struct dialogflow_session *session)
+{
+    return session->suppressedSeconds;
+}
+
+int df_get_end_of_speech_latency(struct dialogflow_session *session)
+{
+    return session->end_of_speech_latency;
+}
+
 void df_set_debug(struct dialogflow_session *session, int debug)
 {
     std::lock_guard<std::mutex> lock(session->lock);
@@ -949,19 +2941,16 @@ void df_set_debug(struct dialogflow_session *session, int debug)
 
 struct timeval df_get_session_start_time(struct dialogflow_session *session)
 {
-    std::lock_guard<std::mutex> lock(session->lock);
     return session->session_start_time;
 }
 
 struct timeval df_get_session_last_transcription_time(struct dialogflow_session *session)
 {
-    std::lock_guard<std::mutex> lock(session->lock);
     return session->last_transcription_time;
 }
 
 struct timeval df_get_session_intent_detected_time(struct dialogflow_session *session)
 {
-    std::lock_guard<std::mutex> lock(session->lock);
     return session->intent_detected_time;
 }
 
@@ -971,6 +2960,212 @@ void df_set_stop_writes_on_final_transcription(struct dialogflow_session *sessio
     session->stop_writes_on_final_transcription = (stop_writes != 0);
 }
 
+/* length of the well-formed utf-8 sequence starting at value, or 0 if it isn't one */
+static size_t utf8_sequence_length(const unsigned char *value, size_t length)
+{
+    size_t needed;
+    unsigned char low = 0x80, high = 0xbf;
+    if (value[0] >= 0xc2 && value[0] <= 0xdf) {
+        needed = 2;
+    } else if (value[0] >= 0xe0 && value[0] <= 0xef) {
+        needed = 3;
+        low = (value[0] == 0xe0) ? 0xa0 : 0x80;
+        high = (value[0] == 0xed) ? 0x9f : 0xbf;
+    } else if (value[0] >= 0xf0 && value[0] <= 0xf4) {
+        needed = 4;
+        low = (value[0] == 0xf0) ? 0x90 : 0x80;
+        high = (value[0] == 0xf4) ? 0x8f : 0xbf;
+    } else {
+        return 0;
+    }
+    if (length < needed || value[1] < low || value[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < needed; i++) {
+        if (value[i] < 0x80 || value[i] > 0xbf) {
+            return 0;
+        }
+    }
+    return needed;
+}
+
+/* invalid utf-8 becomes U+FFFD so the line stays valid json */
+static void append_json_string(std::string& out, const char *value, size_t length)
+{
+    out += '"';
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char) value[i];
+        if (c >= 0x80) {
+            size_t sequence_length = utf8_sequence_length((const unsigned char *) value + i, length - i);
+            if (sequence_length == 0) {
+                out += "\\ufffd";
+            } else {
+                out.append(value + i, sequence_length);
+                i += sequence_length - 1;
+            }
+        } else if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+static void append_json_string(std::string& out, const char *value)
+{
+    append_json_string(out, value, strlen(value));
+}
+
+/* streams one batch item as fast as the stream takes it, returning its error or an empty string */
+static std::string stream_batch_item(struct dialogflow_session *session, const struct dialogflow_batch_item *item)
+{
+    std::ifstream file;
+    if (item->path != nullptr) {
+        file.open(item->path, std::ios::binary);
+        if (!file) {
+            return std::string("can't open ") + item->path + ": " + strerror(errno);
+        }
+    }
+
+    char chunk[DF_BATCH_CHUNK_BYTES];
+    size_t offset = 0;
+    for (;;) {
+        const char *samples = chunk;
+        size_t length;
+        if (item->path != nullptr) {
+            file.read(chunk, sizeof(chunk));
+            length = (size_t) file.gcount();
+        } else {
+            samples = item->data + offset;
+            length = std::min(item->length - offset, sizeof(chunk));
+            offset += length;
+        }
+        if (length == 0) {
+            break;
+        }
+        if (df_wait_for_writes(session, DF_BATCH_MAX_PENDING, DF_BATCH_WRITE_TIMEOUT_MS)) {
+            /* a recognition that ended early - single utterance, or an error - still has results to report */
+            enum dialogflow_session_state state = df_get_state(session);
+            if (state == DF_STATE_STARTED || state == DF_STATE_STARTING) {
+                return "timed out writing audio";
+            }
+            break;
+        }
+        enum dialogflow_session_state state = df_write_audio(session, samples, length);
+        if (state != DF_STATE_STARTED && state != DF_STATE_STARTING) {
+            break;
+        }
+    }
+    return std::string();
+}
+
+static bool run_batch_item(const struct dialogflow_batch_item *item, size_t index, const char *language,
+    DF_BATCH_SETUP_FUNC setup_function, void *user_data, std::string& json)
+{
+    timeval start = tvnow();
+    std::string error;
+    struct dialogflow_session *session = df_create_session(user_data);
+    if (session == nullptr) {
+        error = "can't create a session";
+    } else {
+        df_set_session_id(session, ("batch-" + std::to_string(index)).c_str());
+        /* a recording is recognized whole rather than stopping at its first utterance, unless setup_function says otherwise */
+        df_set_use_external_endpointer(session, 1);
+        if (setup_function != nullptr && setup_function(user_data, item, session)) {
+            error = "setup failed";
+        } else if (df_start_recognition(session, language, 0, nullptr, 0)) {
+            error = "can't start recognition";
+        } else {
+            error = stream_batch_item(session, item);
+            df_stop_recognition(session);
+        }
+    }
+
+    /* errors from the stream itself come back as results */
+    std::string results;
+    int count = (session != nullptr && error.empty()) ? df_get_result_count(session) : 0;
+    for (int i = 0; i < count; i++) {
+        struct dialogflow_result *result = df_get_result(session, i);
+        if (!strcmp(result->slot, "error")) {
+            error = std::string(result->value, result->valueLen);
+            continue;
+        } else if (!strcmp(result->slot, "output_audio")) {
+            continue;
+        }
+        results += results.empty() ? "{\"slot\":" : ",{\"slot\":";
+        append_json_string(results, result->slot);
+        results += ",\"value\":";
+        append_json_string(results, result->value, result->valueLen);
+        results += ",\"score\":" + std::to_string(result->score) + "}";
+    }
+
+    bool ok = error.empty();
+    json = "{\"name\":";
+    append_json_string(json, cstr_or(item->name, ""));
+    json += ok ? ",\"ok\":true" : ",\"ok\":false";
+    json += ",\"audio_bytes\":" + std::to_string(session != nullptr ? df_get_source_bytes_written(session) : 0);
+    json += ",\"elapsed_ms\":" + std::to_string(tvdiff_ms(tvnow(), start));
+    if (!results.empty() || ok) {
+        json += ",\"results\":[" + results + "]";
+    }
+    if (!ok) {
+        json += ",\"error\":";
+        append_json_string(json, error.data(), error.size());
+    }
+    json += "}";
+
+    if (session != nullptr) {
+        df_close_session(session);
+    }
+    return ok;
+}
+
+int df_recognize_batch(const struct dialogflow_batch_item *items, size_t item_count, size_t concurrency,
+    const char *language, DF_BATCH_SETUP_FUNC setup_function, DF_BATCH_RESULT_FUNC result_function, void *user_data)
+{
+    if (items == nullptr && item_count > 0) {
+        return -1;
+    }
+    if (concurrency == 0) {
+        concurrency = std::max(1u, std::thread::hardware_concurrency());
+    }
+    concurrency = std::min(concurrency, item_count);
+
+    std::atomic<size_t> next_item(0);
+    std::atomic<int> failures(0);
+    std::mutex result_lock;
+    auto worker = [&] {
+        size_t index;
+        while ((index = next_item++) < item_count) {
+            std::string json;
+            if (!run_batch_item(&items[index], index, language, setup_function, user_data, json)) {
+                failures++;
+            }
+            if (result_function != nullptr) {
+                std::lock_guard<std::mutex> lock(result_lock);
+                result_function(user_data, &items[index], json.c_str());
+            }
+        }
+    };
+
+    df_log(LOG_DEBUG, "Recognizing a batch of %d items, %d at a time\n", (int) item_count, (int) concurrency);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < concurrency; i++) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread& thread : workers) {
+        thread.join();
+    }
+    return failures;
+}
 
 int google_synth_speech(const char *endpoint, const char *svc_key, const char *text, const char *language, const char *voice_name, const char *destination_filename)
 {
@@ -978,13 +3173,15 @@ int google_synth_speech(const char *endpoint, const char *svc_key, const char *t
         endpoint = "texttospeech.googleapis.com";
     }
 
-    std::shared_ptr<Channel> channel = create_grpc_channel(endpoint, svc_key);
+    std::string channel_key = make_channel_pool_key(endpoint, cstr_or(svc_key, ""));
+    std::shared_ptr<df_channel_group> channel_group = acquire_channel_group(channel_key, endpoint, cstr_or(svc_key, ""));
     
-    if (channel == nullptr) {
+    if (channel_group == nullptr) {
         df_log(LOG_ERROR, "Failed to create synthesis channel to %s\n", endpoint);
         return -1;
     }
 
+    std::shared_ptr<Channel> channel = select_channel_shard(*channel_group, text, false)->channel;
     std::unique_ptr<TextToSpeech::Stub> tts = TextToSpeech::NewStub(channel);
 
     std::string strText(text);
@@ -1006,6 +3203,7 @@ int google_synth_speech(const char *endpoint, const char *svc_key, const char *t
     request.mutable_audio_config()->set_sample_rate_hertz(8000);
 
     Status status = tts->SynthesizeSpeech(&context, request, &response);
+    release_channel_group(channel_key);
     if (!status.ok()) {
         df_log(LOG_WARNING, "Speech synthesis failed: %s (%d)\n", status.error_message().c_str(), status.error_code());
         df_log(LOG_DEBUG, "Error details: %s\n", status.error_details().c_str());
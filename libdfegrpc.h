@@ -18,9 +18,38 @@ enum dialogflow_session_state {
     DF_STATE_STARTED,
     DF_STATE_FINISHED,
     DF_STATE_ERROR,
+    /* only with a start pre-roll: the stream is still being set up, audio written now is held until it is */
+    DF_STATE_STARTING,
     DF_STATE_COUNT
 };
 
+/* matches google.cloud.dialogflow.v2beta1.AudioEncoding */
+enum dialogflow_audio_encoding {
+    DF_AUDIO_ENCODING_LINEAR_16 = 1,
+    DF_AUDIO_ENCODING_FLAC = 2,
+    DF_AUDIO_ENCODING_MULAW = 3,
+    DF_AUDIO_ENCODING_AMR = 4,
+    DF_AUDIO_ENCODING_AMR_WB = 5,
+    DF_AUDIO_ENCODING_OGG_OPUS = 6,
+    DF_AUDIO_ENCODING_SPEEX_WITH_HEADER_BYTE = 7
+};
+
+/* formats df_write_audio can convert from before sending */
+enum dialogflow_source_audio_format {
+    DF_SOURCE_AUDIO_NATIVE,         /* already in the input audio format, sent as is */
+    DF_SOURCE_AUDIO_MULAW,
+    DF_SOURCE_AUDIO_ALAW,
+    DF_SOURCE_AUDIO_SLIN            /* signed 16 bit little endian */
+};
+
+/* what DF_EVENT_OUTPUT_AUDIO carries */
+enum dialogflow_output_audio_format {
+    DF_OUTPUT_AUDIO_AS_SENT,        /* the WAV file the server sent */
+    DF_OUTPUT_AUDIO_SLIN,           /* just its samples, signed 16 bit little endian */
+    DF_OUTPUT_AUDIO_MULAW,
+    DF_OUTPUT_AUDIO_ALAW
+};
+
 enum dialogflow_log_level {
     DF_LOG_LEVEL_DEBUG,
     DF_LOG_LEVEL_INFO,
@@ -35,6 +64,19 @@ struct dialogflow_result {
     int score;
 };
 
+/* output audio as the server sent it. when it's a WAV file the format fields describe it, otherwise they're 0 and the
+   samples are all of data */
+struct dialogflow_output_audio {
+    const char *data;
+    size_t length;
+    int format;                     /* WAVE format tag - 1 is PCM, 6 A-law, 7 mu-law */
+    int channels;
+    int sample_rate;
+    int bits_per_sample;
+    size_t samples_offset;          /* where the samples start in data */
+    size_t samples_length;
+};
+
 enum dialogflow_log_data_value_type {
     dialogflow_log_data_value_type_string = 0,
     dialogflow_log_data_value_type_array_of_string
@@ -47,13 +89,67 @@ struct dialogflow_log_data {
     size_t value_count;
 };
 
+enum dialogflow_event_type {
+    DF_EVENT_TRANSCRIPTION,         /* interim transcription - text, stability, offset */
+    DF_EVENT_FINAL_TRANSCRIPTION,   /* text, confidence, offset */
+    DF_EVENT_END_OF_UTTERANCE,
+    DF_EVENT_QUERY_RESULT,          /* text (query text), confidence, intent_display_name, action, fulfillment_text */
+    DF_EVENT_OUTPUT_AUDIO,          /* audio, audio_len */
+    DF_EVENT_ERROR,                 /* text (error message), error_code */
+    DF_EVENT_FINISHED,              /* recognition is over and the results are ready */
+    DF_EVENT_STATE_CHANGED          /* state - only queued for the event descriptor, never passed to callbacks */
+};
+
+/* pointers are only valid for the duration of the callback */
+struct dialogflow_event {
+    enum dialogflow_event_type type;
+    const char *text;
+    float confidence;
+    float stability;
+    double offset;
+    const char *intent_display_name;
+    const char *action;
+    const char *fulfillment_text;
+    const char *audio;
+    size_t audio_len;
+    int error_code;
+    enum dialogflow_session_state state;
+};
+
 typedef void (*DF_LOG_FUNC)(enum dialogflow_log_level level, const char *file, int line, const char *function, const char *fmt, va_list args);
+/* the "results" entry comes when the recognition is stopped, the next one starts or the session is closed, on whichever
+   thread does that, always ahead of the turn's "stop" - which for df_recognize_event_async waits along with it */
 typedef void (*DF_CALL_LOG_FUNC)(void *user_data, const char *event, size_t log_data_size, const struct dialogflow_log_data *data);
+/* called from the library's completion threads as responses arrive, so it must not block. starting, stopping or
+   closing the session from it would wait on the call being handled, so those fail there - use df_close_session_async */
+typedef void (*DF_EVENT_FUNC)(struct dialogflow_session *session, void *user_data, const struct dialogflow_event *event);
 
+/*!! Set the number of threads driving streaming calls (call before df_init, 0 picks one per core up to 4) */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_completion_threads(size_t thread_count);
 extern LIBDFEGRPC_DLL_EXPORTED int df_init(DF_LOG_FUNC log_function, DF_CALL_LOG_FUNC call_log_function);
 extern LIBDFEGRPC_DLL_EXPORTED int df_shutdown(void);
+/*!! Set how many connections are opened to each endpoint, and how many streams a connection carries before sessions spread
+     to another one (growing the set up to max_shards); 0 max_streams_per_shard assigns sessions purely by session id */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_channel_shards(size_t shards, size_t max_shards, size_t max_streams_per_shard);
 extern LIBDFEGRPC_DLL_EXPORTED struct dialogflow_session *df_create_session(void *user_data);
 extern LIBDFEGRPC_DLL_EXPORTED int df_close_session(struct dialogflow_session *session);
+/*!! Close the session without waiting: any recognition is told no more audio is coming and the session is closed on a
+     background thread once its calls finish, with the usual "stop" and "destroy" call log entries. the session must not be
+     used after this (until it's gone, starting a recognition fails and df_write_audio returns DF_STATE_FINISHED), but its
+     user_data must stay valid until "destroy" is logged */
+extern LIBDFEGRPC_DLL_EXPORTED int df_close_session_async(struct dialogflow_session *session);
+/*!! How long a session closed with df_close_session_async may take to finish before its calls are cancelled, 10s by default */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_async_close_timeout(int timeout_ms);
+/*!! Set the callback receiving events for every session that doesn't have one of its own */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_global_event_callback(DF_EVENT_FUNC event_function);
+/*!! Set the callback receiving this session's events (user_data is the session's user data) */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_event_callback(struct dialogflow_session *session, DF_EVENT_FUNC event_function);
+/*!! Get a descriptor that polls readable while the session has events pending (events are only queued once this is called).
+     besides the callback's events, each change of df_get_state is queued as DF_EVENT_STATE_CHANGED */
+extern LIBDFEGRPC_DLL_EXPORTED int df_get_event_fd(struct dialogflow_session *session);
+/*!! Take the next pending event without blocking - returns 1 with the event filled in, 0 when none are left.
+     pointers in the event are valid until the next call or the session is destroyed */
+extern LIBDFEGRPC_DLL_EXPORTED int df_get_next_event(struct dialogflow_session *session, struct dialogflow_event *event);
 extern LIBDFEGRPC_DLL_EXPORTED int df_set_auth_key(struct dialogflow_session *session, const char *auth_key);
 extern LIBDFEGRPC_DLL_EXPORTED int df_set_endpoint(struct dialogflow_session *session, const char *endpoint);
 extern LIBDFEGRPC_DLL_EXPORTED int df_set_session_id(struct dialogflow_session *session, const char *session_id);
@@ -66,22 +162,135 @@ extern LIBDFEGRPC_DLL_EXPORTED int df_set_use_external_endpointer(struct dialogf
 /*!! Set the model for use by the intent detection request */
 extern LIBDFEGRPC_DLL_EXPORTED int df_set_model(struct dialogflow_session *session, const char *model);
 extern LIBDFEGRPC_DLL_EXPORTED int df_recognize_event(struct dialogflow_session *session, const char *event, const char *language, int request_audio);
+/*!! Like df_recognize_event but returns once the request is sent. Completion is reported through the session's
+     events, DF_EVENT_QUERY_RESULT and DF_EVENT_OUTPUT_AUDIO or DF_EVENT_ERROR, then DF_EVENT_FINISHED, after which
+     the results are available as usual. starting another recognition waits for it, closing the session cancels it */
+extern LIBDFEGRPC_DLL_EXPORTED int df_recognize_event_async(struct dialogflow_session *session, const char *event, const char *language, int request_audio);
 extern LIBDFEGRPC_DLL_EXPORTED void df_connect(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED int df_start_recognition(struct dialogflow_session *session, const char *language, int request_audio, const char **hints, size_t hints_count);
 extern LIBDFEGRPC_DLL_EXPORTED int df_stop_recognition(struct dialogflow_session *session);
+/*!! Format of the audio passed to df_write_audio, which is sent on as is. defaults to 8kHz mu-law.
+     takes effect at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_input_audio_format(struct dialogflow_session *session, enum dialogflow_audio_encoding encoding, int sample_rate_hertz);
+/*!! Format of the audio the caller writes when it differs from the input audio format; df_write_audio then converts it,
+     resampling if the rates differ. conversion is to LINEAR_16 or MULAW input only. DF_SOURCE_AUDIO_NATIVE, the default,
+     turns it off. takes effect at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_source_audio_format(struct dialogflow_session *session, enum dialogflow_source_audio_format format, int sample_rate_hertz);
+/*!! Format of the audio in DF_EVENT_OUTPUT_AUDIO, which is emitted as soon as the response carrying it arrives. the server
+     sends 8kHz 16 bit linear WAV; anything but DF_OUTPUT_AUDIO_AS_SENT (the default) strips the header so each event can be
+     played straight away, converting the samples if asked. df_get_output_audio and the output_audio result keep the WAV */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_output_audio_format(struct dialogflow_session *session, enum dialogflow_output_audio_format format);
+/*!! Compress audio to Ogg Opus at this many bits per second before sending it, 0 (the default) sends it uncompressed.
+     the audio written is described by df_set_source_audio_format, or by the input audio format when that isn't set,
+     and must be mu-law, A-law or 16 bit linear. fails unless the library was built with opus. takes effect at the
+     next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_opus_compression(struct dialogflow_session *session, int bitrate);
+/*!! Hold back written audio until it hears speech, then send it along with up to pre_roll_ms of the audio before,
+     and hold it back again after trailing_silence_ms of silence (0 keeps sending once speech starts). speech is audio
+     louder than threshold_dbfs - -40 is a reasonable start - and 0 turns the gate off. the audio must be mu-law, A-law
+     or 16 bit linear. keep in mind the server may end a stream that goes too long without audio. takes effect at the
+     next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_voice_gate(struct dialogflow_session *session, int threshold_dbfs, int pre_roll_ms, int trailing_silence_ms);
+/*!! Audio the voice gate kept from being sent during the current recognition */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_suppressed_bytes(struct dialogflow_session *session);
+extern LIBDFEGRPC_DLL_EXPORTED double df_get_suppressed_seconds(struct dialogflow_session *session);
+/*!! With an external endpointer, have the library find the end of speech in the audio written and tell the server no
+     more is coming, as df_stop_recognition would: speech louder than threshold_dbfs followed by hangover_ms of silence.
+     a min_stability above 0 also waits for an interim transcript at least that stable, or twice the hangover. 0
+     threshold_dbfs turns it off. the audio must be mu-law, A-law or 16 bit linear. takes effect at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_local_endpointer(struct dialogflow_session *session, int threshold_dbfs, int hangover_ms, float min_stability);
+/*!! Have df_start_recognition return without waiting for the stream to be set up, leaving the session in
+     DF_STATE_STARTING until it is. audio written meanwhile is held, up to max_bytes of it, and sent in order
+     once the stream is up - anything past that is dropped. 0, the default, waits for the stream. takes effect
+     at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_start_pre_roll(struct dialogflow_session *session, size_t max_bytes);
+/*!! Audio dropped during the current recognition because the start pre-roll was full */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_pre_roll_dropped_bytes(struct dialogflow_session *session);
+/*!! Milliseconds from the last speech the local endpointer heard to the end of writes in the current recognition, -1 if not known */
+extern LIBDFEGRPC_DLL_EXPORTED int df_get_end_of_speech_latency(struct dialogflow_session *session);
+/*!! Collect written audio into packets of at least this many bytes before sending it, trading latency for fewer
+     messages on the stream (8 bytes is 1ms of 8kHz mu-law, so 480 bytes is 60ms). max_delay_ms bounds how long a
+     partial packet waits for more audio, 0 waits until the packet fills or recognition stops. bytes of 0, the default,
+     sends each df_write_audio call as its own packet. takes effect at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_audio_coalescing(struct dialogflow_session *session, size_t bytes, int max_delay_ms);
+/*!! Send audio on a generic stream with each packet's protobuf encoding written directly in front of a single copy of
+     the samples, rather than building and serializing a request message per packet. takes effect at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_raw_audio_writes(struct dialogflow_session *session, int raw_audio_writes);
+/*!! Have df_write_audio copy audio into a ring of this many bytes and return at once, leaving the sending to the
+     library's own threads (0, the default, queues a request per call instead). takes effect at the next df_start_recognition */
+extern LIBDFEGRPC_DLL_EXPORTED int df_set_audio_ring_size(struct dialogflow_session *session, size_t ring_size);
+/*!! The most audio that was waiting in the ring during the current recognition */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_audio_ring_high_water(struct dialogflow_session *session);
+/*!! Audio dropped during the current recognition because the ring was full */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_audio_dropped_bytes(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED enum dialogflow_session_state df_write_audio(struct dialogflow_session *session, const char *samples, size_t sample_count);
+/*!! Wait until no more than max_pending packets written with df_write_audio are waiting for the stream to take them
+     (and with an audio ring, until it's no more than half full), so recorded audio can be written as fast as flow
+     control allows rather than in real time. a negative timeout_ms waits as long as it takes. returns 0 when there's
+     room, -1 on timeout or when the recognition isn't running */
+extern LIBDFEGRPC_DLL_EXPORTED int df_wait_for_writes(struct dialogflow_session *session, size_t max_pending, int timeout_ms);
 extern LIBDFEGRPC_DLL_EXPORTED enum dialogflow_session_state df_get_state(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED int df_get_rpc_state(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED int df_get_result_count(struct dialogflow_session *session);
 /* structure is valid until session is destroyed or recognition re-started */
 extern LIBDFEGRPC_DLL_EXPORTED struct dialogflow_result *df_get_result(struct dialogflow_session *session, int number);
+/*!! Look a result up by its slot name rather than scanning them, NULL if there isn't one. valid as df_get_result's are */
+extern LIBDFEGRPC_DLL_EXPORTED struct dialogflow_result *df_get_result_by_name(struct dialogflow_session *session, const char *name);
+/*!! Step through the results whose slot names start with prefix - "text" gives text, text_1 and so on, a parameter's
+     name and '_' its nested values - in the order df_get_result has them. start position at 0, each call moves it past
+     the result returned; NULL once there are no more */
+extern LIBDFEGRPC_DLL_EXPORTED struct dialogflow_result *df_get_next_result_with_prefix(struct dialogflow_session *session, const char *prefix, int *position);
 extern LIBDFEGRPC_DLL_EXPORTED int df_get_response_count(struct dialogflow_session *session);
+/*!! Borrow the output audio of the latest results without copying it - the same bytes as the output_audio result,
+     which is only there when the audio is a WAV file. audio that isn't one still returns 0, with samples_offset 0 and
+     samples_length the whole length. returns -1 if there isn't any. valid as long as the results are */
+extern LIBDFEGRPC_DLL_EXPORTED int df_get_output_audio(struct dialogflow_session *session, struct dialogflow_output_audio *audio);
+/*!! The final response behind the latest results as serialized protobuf: a StreamingDetectIntentResponse after a
+     streaming recognition, a DetectIntentResponse after an event. made on the first call and kept with the results,
+     valid as long as they are. returns -1 if there isn't one, as when the recognition failed */
+extern LIBDFEGRPC_DLL_EXPORTED int df_get_final_response(struct dialogflow_session *session, const char **data, size_t *length);
+/*!! The same response in protobuf's canonical JSON mapping, nul terminated */
+extern LIBDFEGRPC_DLL_EXPORTED int df_get_final_response_json(struct dialogflow_session *session, const char **json, size_t *length);
+/*!! Memory taken for the responses of the current recognition, and how many times reading one needed more of it from the heap */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_response_bytes(struct dialogflow_session *session);
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_response_allocations(struct dialogflow_session *session);
+/*!! Audio bytes and packets (counting the initial configuration) written in the current recognition, as sent after any conversion or compression */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_bytes_written(struct dialogflow_session *session);
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_packets_written(struct dialogflow_session *session);
+/*!! Audio bytes passed to df_write_audio in the current recognition, before any conversion or compression */
+extern LIBDFEGRPC_DLL_EXPORTED size_t df_get_source_bytes_written(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED void df_set_debug(struct dialogflow_session *session, int debug);
 extern LIBDFEGRPC_DLL_EXPORTED struct timeval df_get_session_start_time(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED struct timeval df_get_session_last_transcription_time(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED struct timeval df_get_session_intent_detected_time(struct dialogflow_session *session);
 extern LIBDFEGRPC_DLL_EXPORTED void df_set_stop_writes_on_final_transcription(struct dialogflow_session *session, int stop_writes);
 
+/* a recording for df_recognize_batch, read from path or, when that's NULL, taken from data */
+struct dialogflow_batch_item {
+    const char *name;               /* identifies the item in its result */
+    const char *path;
+    const char *data;
+    size_t length;
+};
+
+/* sets up an item's session (auth key, project, audio format and so on) before its recognition starts. non-zero fails the item */
+typedef int (*DF_BATCH_SETUP_FUNC)(void *user_data, const struct dialogflow_batch_item *item, struct dialogflow_session *session);
+/* gets an item's result as a single line JSON object, without the newline. calls are made one at a time */
+typedef void (*DF_BATCH_RESULT_FUNC)(void *user_data, const struct dialogflow_batch_item *item, const char *json);
+
+/*!! Recognize a set of recordings, running up to concurrency of them at once (0 runs one per core). each is streamed as
+     fast as flow control allows, then its results are passed to result_function as
+     {"name":...,"ok":...,"audio_bytes":...,"elapsed_ms":...,"results":[{"slot":...,"value":...,"score":...},...]}
+     plus an "error" whenever ok is false; results are left out if it failed before any came back. invalid UTF-8 in values
+     is replaced with U+FFFD. sessions are created with user_data and
+     a session id of batch-<item index>, which setup_function may change.
+     each item is recognized as one turn over the whole recording (the
+     external endpointer is on); setup_function can call
+     df_set_use_external_endpointer(session, 0) to stop at the first
+     utterance instead. returns how many items failed, -1 on bad arguments */
+extern LIBDFEGRPC_DLL_EXPORTED int df_recognize_batch(const struct dialogflow_batch_item *items, size_t item_count, size_t concurrency,
+    const char *language, DF_BATCH_SETUP_FUNC setup_function, DF_BATCH_RESULT_FUNC result_function, void *user_data);
+
 extern LIBDFEGRPC_DLL_EXPORTED int google_synth_speech(const char *endpoint, const char *svc_key, const char *text, 
     const char *language, const char *voice_name, const char *destination_filename);
 
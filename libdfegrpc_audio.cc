@@ -0,0 +1,816 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "libdfegrpc_audio.h"
+
+#ifdef HAVE_OPUS
+#include <opus/opus.h>
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "libdfegrpc_audio_kernels.h"
+
+/* resampling ratios beyond this would need unreasonably large coefficient tables */
+#define DF_MAX_RESAMPLE_PHASES 1000
+
+/* taps per output sample at a 1:1 ratio, more are used when decimating */
+#define DF_RESAMPLE_TAPS 24
+
+/* each ogg page costs 27 bytes plus a byte per packet, so pages carry a few packets.
+   three 20ms packets adds at most 40ms before audio is sent */
+#define DF_OPUS_FRAME_MS 20
+#define DF_OPUS_PACKETS_PER_PAGE 3
+#define DF_OPUS_MAX_PACKET 1275
+
+#define DF_OGG_BEGINNING_OF_STREAM 0x02
+#define DF_OGG_END_OF_STREAM 0x04
+
+/* speech must last this many 10ms frames to count, so clicks don't */
+#define DF_VOICE_GATE_SPEECH_FRAMES 3
+/* white noise changes sign on about half its samples, voiced speech on a fifth or fewer */
+#define DF_VOICE_GATE_MAX_CROSSING_PERCENT 30
+
+static void scalar_ulaw_to_linear_block(const uint8_t *in, int16_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = scalar_ulaw_to_linear(in[i]);
+    }
+}
+
+static void scalar_alaw_to_linear_block(const uint8_t *in, int16_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = scalar_alaw_to_linear(in[i]);
+    }
+}
+
+static void scalar_linear_to_ulaw_block(const int16_t *in, uint8_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = scalar_linear_to_ulaw(in[i]);
+    }
+}
+
+static void scalar_linear_to_alaw_block(const int16_t *in, uint8_t *out, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        out[i] = scalar_linear_to_alaw(in[i]);
+    }
+}
+
+static float scalar_dot_product(const float *a, const float *b, size_t count)
+{
+    float sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void scalar_frame_stats(const int16_t *in, size_t count, uint64_t *energy, size_t *zero_crossings)
+{
+    uint64_t sum = 0;
+    size_t crossings = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (int32_t) in[i] * in[i];
+        if (i > 0 && ((in[i] ^ in[i - 1]) & 0x8000)) {
+            crossings++;
+        }
+    }
+    *energy = sum;
+    *zero_crossings = crossings;
+}
+
+static const struct df_audio_kernels scalar_kernels = {
+    "scalar",
+    scalar_ulaw_to_linear_block,
+    scalar_alaw_to_linear_block,
+    scalar_linear_to_ulaw_block,
+    scalar_linear_to_alaw_block,
+    scalar_dot_product,
+    scalar_frame_stats
+};
+
+const struct df_audio_kernels *df_audio_kernels_scalar(void)
+{
+    return &scalar_kernels;
+}
+
+#if defined(__SSE2__)
+
+struct sse2_ops {
+    typedef __m128i v;
+    static const size_t lanes = 8;
+
+    static v load_bytes(const uint8_t *p) { return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) p), _mm_setzero_si128()); }
+    static void store_bytes(uint8_t *p, v a) { _mm_storel_epi64((__m128i *) p, _mm_packus_epi16(a, a)); }
+    static v load(const int16_t *p) { return _mm_loadu_si128((const __m128i *) p); }
+    static void store(int16_t *p, v a) { _mm_storeu_si128((__m128i *) p, a); }
+    static v set1(int16_t x) { return _mm_set1_epi16(x); }
+    static v and_(v a, v b) { return _mm_and_si128(a, b); }
+    static v or_(v a, v b) { return _mm_or_si128(a, b); }
+    static v xor_(v a, v b) { return _mm_xor_si128(a, b); }
+    static v andnot(v a, v b) { return _mm_andnot_si128(a, b); }
+    static v add(v a, v b) { return _mm_add_epi16(a, b); }
+    static v sub(v a, v b) { return _mm_sub_epi16(a, b); }
+    static v mullo(v a, v b) { return _mm_mullo_epi16(a, b); }
+    static v mulhi_unsigned(v a, v b) { return _mm_mulhi_epu16(a, b); }
+    template<int n> static v slli(v a) { return _mm_slli_epi16(a, n); }
+    template<int n> static v srli(v a) { return _mm_srli_epi16(a, n); }
+    template<int n> static v srai(v a) { return _mm_srai_epi16(a, n); }
+    static v cmpeq(v a, v b) { return _mm_cmpeq_epi16(a, b); }
+    static v cmpgt(v a, v b) { return _mm_cmpgt_epi16(a, b); }
+    static v min(v a, v b) { return _mm_min_epi16(a, b); }
+};
+
+static void sse2_ulaw_to_linear(const uint8_t *in, int16_t *out, size_t count)
+{
+    vector_ulaw_to_linear<sse2_ops>(in, out, count);
+}
+
+static void sse2_alaw_to_linear(const uint8_t *in, int16_t *out, size_t count)
+{
+    vector_alaw_to_linear<sse2_ops>(in, out, count);
+}
+
+static void sse2_linear_to_ulaw(const int16_t *in, uint8_t *out, size_t count)
+{
+    vector_linear_to_ulaw<sse2_ops>(in, out, count);
+}
+
+static void sse2_linear_to_alaw(const int16_t *in, uint8_t *out, size_t count)
+{
+    vector_linear_to_alaw<sse2_ops>(in, out, count);
+}
+
+static float sse2_dot_product(const float *a, const float *b, size_t count)
+{
+    __m128 sum = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, sum);
+    float total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static void sse2_frame_stats(const int16_t *in, size_t count, uint64_t *energy, size_t *zero_crossings)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i sum = zero;
+    __m128i crossings = zero;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        /* pairs of squares fit 32 bits unsigned, so widen before they're added up */
+        __m128i squares = _mm_madd_epi16(_mm_loadu_si128((const __m128i *) (in + i)), _mm_loadu_si128((const __m128i *) (in + i)));
+        sum = _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(squares, zero), _mm_unpackhi_epi32(squares, zero)));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, sum);
+    uint64_t total = lanes[0] + lanes[1];
+    for (; i < count; i++) {
+        total += (int32_t) in[i] * in[i];
+    }
+
+    for (i = 1; i + 8 <= count; i += 8) {
+        /* -1 in each lane whose sign differs from the sample before it */
+        __m128i changes = _mm_srai_epi16(_mm_xor_si128(_mm_loadu_si128((const __m128i *) (in + i)), _mm_loadu_si128((const __m128i *) (in + i - 1))), 15);
+        crossings = _mm_sub_epi32(crossings, _mm_madd_epi16(changes, ones));
+    }
+    uint32_t counts[4];
+    _mm_storeu_si128((__m128i *) counts, crossings);
+    size_t changed = (size_t) counts[0] + counts[1] + counts[2] + counts[3];
+    for (; i < count; i++) {
+        if ((in[i] ^ in[i - 1]) & 0x8000) {
+            changed++;
+        }
+    }
+
+    *energy = total;
+    *zero_crossings = changed;
+}
+
+static const struct df_audio_kernels sse2_kernels = {
+    "sse2",
+    sse2_ulaw_to_linear,
+    sse2_alaw_to_linear,
+    sse2_linear_to_ulaw,
+    sse2_linear_to_alaw,
+    sse2_dot_product,
+    sse2_frame_stats
+};
+
+const struct df_audio_kernels *df_audio_kernels_sse2(void)
+{
+    return &sse2_kernels;
+}
+
+#else
+
+const struct df_audio_kernels *df_audio_kernels_sse2(void)
+{
+    return nullptr;
+}
+
+#endif
+
+static const struct df_audio_kernels *pick_kernels(void)
+{
+    const struct df_audio_kernels *kernels = df_audio_kernels_avx2();
+    if (kernels == nullptr) {
+        kernels = df_audio_kernels_sse2();
+    }
+    if (kernels == nullptr) {
+        kernels = df_audio_kernels_scalar();
+    }
+    return kernels;
+}
+
+const struct df_audio_kernels *df_audio_kernels_best(void)
+{
+    static const struct df_audio_kernels *best = pick_kernels();
+    return best;
+}
+
+static uint32_t read_le(const unsigned char *p, int bytes)
+{
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+/* walks the chunks after RIFF/WAVE, never reading past length. a data chunk longer than what's there (as when
+   a streamed file gives its size as 0xffffffff) is cut to what's there */
+bool df_parse_wav(const char *data, size_t length, struct dialogflow_output_audio *audio)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+    bool have_format = false;
+
+    audio->format = audio->channels = audio->sample_rate = audio->bits_per_sample = 0;
+    audio->samples_offset = audio->samples_length = 0;
+    if (length < 12 || memcmp(bytes, "RIFF", 4) || memcmp(bytes + 8, "WAVE", 4)) {
+        return false;
+    }
+
+    size_t position = 12;
+    while (length - position >= 8) {
+        const unsigned char *chunk = bytes + position;
+        size_t chunk_length = read_le(chunk + 4, 4);
+        size_t available = length - position - 8;
+
+        if (!memcmp(chunk, "fmt ", 4)) {
+            if (chunk_length < 16 || chunk_length > available) {
+                return false;
+            }
+            audio->format = read_le(chunk + 8, 2);
+            audio->channels = read_le(chunk + 10, 2);
+            audio->sample_rate = read_le(chunk + 12, 4);
+            audio->bits_per_sample = read_le(chunk + 22, 2);
+            /* WAVE_FORMAT_EXTENSIBLE keeps the real tag at the start of its subformat */
+            if (audio->format == 0xfffe && chunk_length >= 26) {
+                audio->format = read_le(chunk + 32, 2);
+            }
+            have_format = true;
+        } else if (!memcmp(chunk, "data", 4)) {
+            if (!have_format) {
+                return false;
+            }
+            audio->samples_offset = position + 8;
+            audio->samples_length = std::min(chunk_length, available);
+            return true;
+        }
+        if (chunk_length > available) {
+            return false;
+        }
+        /* chunks are padded to an even length */
+        position += 8 + chunk_length + (chunk_length & 1);
+        if (position > length) {
+            return false;
+        }
+    }
+    return false;
+}
+
+bool df_convert_output_audio(const char *data, size_t length, enum dialogflow_output_audio_format format, std::string& out)
+{
+    struct dialogflow_output_audio wav;
+    if (format == DF_OUTPUT_AUDIO_AS_SENT) {
+        out.assign(data, length);
+        return true;
+    }
+    if (df_parse_wav(data, length, &wav)) {
+        if (wav.format != 1 || wav.channels != 1 || wav.bits_per_sample != 16) {
+            return false;
+        }
+        data += wav.samples_offset;
+        length = wav.samples_length;
+    }
+
+    /* chunks are padded to even offsets, so the samples stay aligned */
+    const int16_t *samples = (const int16_t *) data;
+    size_t count = length / 2;
+    if (format == DF_OUTPUT_AUDIO_SLIN) {
+        out.assign(data, count * sizeof(int16_t));
+    } else if (format == DF_OUTPUT_AUDIO_MULAW) {
+        out.resize(count);
+        df_audio_kernels_best()->linear_to_ulaw(samples, (uint8_t *) &out[0], count);
+    } else {
+        out.resize(count);
+        df_audio_kernels_best()->linear_to_alaw(samples, (uint8_t *) &out[0], count);
+    }
+    return true;
+}
+
+static int greatest_common_divisor(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+df_resampler::df_resampler(int input_rate, int output_rate, const struct df_audio_kernels *kernels) : kernels(kernels)
+{
+    int divisor = greatest_common_divisor(input_rate, output_rate);
+    up = output_rate / divisor;
+    down = input_rate / divisor;
+    if (up > DF_MAX_RESAMPLE_PHASES) {
+        /* approximate an awkward ratio rather than build a huge table */
+        down = (int) ((int64_t) down * DF_MAX_RESAMPLE_PHASES / up);
+        up = DF_MAX_RESAMPLE_PHASES;
+    }
+    taps = DF_RESAMPLE_TAPS * ((std::max(up, down) + up - 1) / up);
+
+    /* windowed sinc low pass at the lower of the two nyquist frequencies, in units of the upsampled rate */
+    size_t length = taps * up;
+    double cutoff = 0.45 / std::max(up, down);
+    double center = (length - 1) / 2.0;
+    std::vector<double> prototype(length);
+    double sum = 0;
+    for (size_t k = 0; k < length; k++) {
+        double x = k - center;
+        double sinc = (x == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+        double window = 0.42 - 0.5 * cos(2 * M_PI * k / (length - 1)) + 0.08 * cos(4 * M_PI * k / (length - 1));
+        prototype[k] = sinc * window;
+        sum += prototype[k];
+    }
+
+    coefficients.resize(length);
+    for (int phase = 0; phase < up; phase++) {
+        for (size_t j = 0; j < taps; j++) {
+            coefficients[phase * taps + (taps - 1 - j)] = (float) (prototype[phase + j * up] * up / sum);
+        }
+    }
+
+    history.assign(taps - 1, 0.0f);
+    position = (uint64_t) (taps - 1) * up;
+}
+
+void df_resampler::process(const int16_t *in, size_t count, std::vector<int16_t>& out)
+{
+    for (size_t i = 0; i < count; i++) {
+        history.push_back(in[i]);
+    }
+
+    while (position / up < history.size()) {
+        size_t newest = position / up;
+        size_t phase = position % up;
+        float sample = kernels->dot_product(&coefficients[phase * taps], &history[newest + 1 - taps], taps);
+        out.push_back((int16_t) std::max(-32768.0f, std::min(32767.0f, roundf(sample))));
+        position += down;
+    }
+
+    /* keep the samples the next output still reaches back to */
+    size_t consumed = history.size() - (taps - 1);
+    history.erase(history.begin(), history.begin() + consumed);
+    position -= (uint64_t) consumed * up;
+}
+
+bool df_speech_detector::supports(enum dialogflow_source_audio_format format)
+{
+    return format == DF_SOURCE_AUDIO_MULAW || format == DF_SOURCE_AUDIO_ALAW || format == DF_SOURCE_AUDIO_SLIN;
+}
+
+df_speech_detector::df_speech_detector(enum dialogflow_source_audio_format format, int sample_rate, int threshold_dbfs) :
+    bytes_per_second(sample_rate * (format == DF_SOURCE_AUDIO_SLIN ? 2 : 1)),
+    frame_bytes(std::max(sample_rate / 100, 1) * (format == DF_SOURCE_AUDIO_SLIN ? 2 : 1)),
+    kernels(df_audio_kernels_best()),
+    format(format)
+{
+    linear.resize(std::max(sample_rate / 100, 1));
+    /* compare sums of squares rather than taking a log per frame */
+    threshold_energy = 32768.0 * 32768.0 * pow(10.0, threshold_dbfs / 10.0) * linear.size();
+}
+
+bool df_speech_detector::is_speech(const char *frame)
+{
+    size_t count = linear.size();
+    switch (format) {
+    case DF_SOURCE_AUDIO_MULAW:
+        kernels->ulaw_to_linear((const uint8_t *) frame, linear.data(), count);
+        break;
+    case DF_SOURCE_AUDIO_ALAW:
+        kernels->alaw_to_linear((const uint8_t *) frame, linear.data(), count);
+        break;
+    default:
+        memcpy(linear.data(), frame, count * sizeof(int16_t));
+        break;
+    }
+
+    uint64_t energy;
+    size_t zero_crossings;
+    kernels->frame_stats(linear.data(), count, &energy, &zero_crossings);
+    return energy > threshold_energy && zero_crossings * 100 < DF_VOICE_GATE_MAX_CROSSING_PERCENT * count;
+}
+
+df_voice_gate::df_voice_gate(enum dialogflow_source_audio_format format, int sample_rate, int threshold_dbfs, int pre_roll_ms, int trailing_silence_ms) :
+    detector(format, sample_rate, threshold_dbfs),
+    /* the frames that open the gate are always kept */
+    pre_roll_bytes(std::max(detector.bytes_per_second * pre_roll_ms / 1000, detector.frame_bytes * DF_VOICE_GATE_SPEECH_FRAMES)),
+    trailing_frames(trailing_silence_ms / 10),
+    open(false),
+    speech_frames(0),
+    silent_frames(0),
+    suppressed(0)
+{
+}
+
+const std::string& df_voice_gate::process(const char *data, size_t length)
+{
+    output.clear();
+    partial_frame.append(data, length);
+
+    size_t frame_bytes = detector.frame_bytes;
+    size_t used = 0;
+    for (; partial_frame.size() - used >= frame_bytes; used += frame_bytes) {
+        const char *frame = partial_frame.data() + used;
+        bool speech = detector.is_speech(frame);
+
+        if (open) {
+            output.append(frame, frame_bytes);
+            silent_frames = speech ? 0 : silent_frames + 1;
+            if (trailing_frames > 0 && silent_frames >= trailing_frames) {
+                open = false;
+                speech_frames = 0;
+            }
+            continue;
+        }
+
+        pre_roll.append(frame, frame_bytes);
+        if (pre_roll.size() > pre_roll_bytes) {
+            size_t excess = pre_roll.size() - pre_roll_bytes;
+            pre_roll.erase(0, excess);
+            suppressed += excess;
+        }
+        speech_frames = speech ? speech_frames + 1 : 0;
+        if (speech_frames >= DF_VOICE_GATE_SPEECH_FRAMES) {
+            output += pre_roll;
+            pre_roll.clear();
+            open = true;
+            silent_frames = 0;
+        }
+    }
+    partial_frame.erase(0, used);
+
+    return output;
+}
+
+df_endpointer::df_endpointer(enum dialogflow_source_audio_format format, int sample_rate, int threshold_dbfs, int hangover_ms, float min_stability) :
+    detector(format, sample_rate, threshold_dbfs),
+    hangover_frames(std::max(hangover_ms / 10, 1)),
+    min_stability(min_stability),
+    speaking(false),
+    speech_heard(false),
+    ended(false),
+    speech_frames(0),
+    silent_frames(0)
+{
+}
+
+bool df_endpointer::process(const char *data, size_t length, float stability)
+{
+    speech_heard = false;
+    if (ended) {
+        return true;
+    }
+    partial_frame.append(data, length);
+
+    size_t frame_bytes = detector.frame_bytes;
+    size_t used = 0;
+    for (; partial_frame.size() - used >= frame_bytes; used += frame_bytes) {
+        if (detector.is_speech(partial_frame.data() + used)) {
+            speech_heard = true;
+            silent_frames = 0;
+            if (++speech_frames >= DF_VOICE_GATE_SPEECH_FRAMES) {
+                speaking = true;
+            }
+        } else {
+            speech_frames = 0;
+            silent_frames++;
+        }
+    }
+    partial_frame.erase(0, used);
+
+    if (speaking && silent_frames >= hangover_frames) {
+        ended = min_stability <= 0 || stability >= min_stability || silent_frames >= 2 * hangover_frames;
+    }
+    return ended;
+}
+
+#ifdef HAVE_OPUS
+
+df_opus_encoder *df_opus_encoder::create(int sample_rate, int bitrate)
+{
+    int error = OPUS_OK;
+    OpusEncoder *encoder = opus_encoder_create(sample_rate, 1, OPUS_APPLICATION_VOIP, &error);
+    if (encoder == nullptr || error != OPUS_OK) {
+        return nullptr;
+    }
+    opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate));
+    opus_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+    /* pre-skip is always counted at 48kHz */
+    return new df_opus_encoder(encoder, sample_rate, lookahead * (48000 / sample_rate));
+}
+
+df_opus_encoder::~df_opus_encoder()
+{
+    opus_encoder_destroy(encoder);
+}
+
+static int encode_frame(OpusEncoder *encoder, const int16_t *samples, size_t count, unsigned char *packet, size_t packet_size)
+{
+    return opus_encode(encoder, samples, count, packet, packet_size);
+}
+
+#else
+
+df_opus_encoder *df_opus_encoder::create(int sample_rate, int bitrate)
+{
+    return nullptr;
+}
+
+df_opus_encoder::~df_opus_encoder()
+{
+}
+
+static int encode_frame(OpusEncoder *encoder, const int16_t *samples, size_t count, unsigned char *packet, size_t packet_size)
+{
+    return -1;
+}
+
+#endif
+
+df_opus_encoder::df_opus_encoder(struct OpusEncoder *encoder, int sample_rate, int pre_skip) :
+    encoder(encoder),
+    sample_rate(sample_rate),
+    frame_samples(sample_rate * DF_OPUS_FRAME_MS / 1000),
+    pre_skip(pre_skip),
+    serial(std::random_device()()),
+    page_sequence(0),
+    samples_encoded(0),
+    headers_written(false),
+    finished(false)
+{
+}
+
+static void append_le(std::string& out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        out += (char) ((value >> (8 * i)) & 0xff);
+    }
+}
+
+/* crc-32 with polynomial 0x04c11db7, unreflected and starting from 0, as ogg wants */
+static uint32_t ogg_crc(const char *data, size_t length)
+{
+    static uint32_t table[256];
+    static bool table_ready = [] {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t r = i << 24;
+            for (int bit = 0; bit < 8; bit++) {
+                r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+            }
+            table[i] = r;
+        }
+        return true;
+    }();
+    (void) table_ready;
+
+    uint32_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc = (crc << 8) ^ table[((crc >> 24) ^ (uint8_t) data[i]) & 0xff];
+    }
+    return crc;
+}
+
+void df_opus_encoder::add_page(std::string& out, const std::string& body, const std::vector<size_t>& packet_sizes, uint8_t flags, uint64_t granule_position)
+{
+    size_t start = out.size();
+    out.append("OggS", 4);
+    out += (char) 0;
+    out += (char) flags;
+    append_le(out, granule_position, 8);
+    append_le(out, serial, 4);
+    append_le(out, page_sequence++, 4);
+    /* the checksum covers the whole page with this field zeroed */
+    append_le(out, 0, 4);
+
+    std::string lacing;
+    for (size_t size : packet_sizes) {
+        for (; size >= 255; size -= 255) {
+            lacing += (char) 255;
+        }
+        lacing += (char) size;
+    }
+    out += (char) lacing.size();
+    out += lacing;
+    out += body;
+
+    uint32_t crc = ogg_crc(out.data() + start, out.size() - start);
+    for (int i = 0; i < 4; i++) {
+        out[start + 22 + i] = (char) ((crc >> (8 * i)) & 0xff);
+    }
+}
+
+void df_opus_encoder::write_headers(std::string& out)
+{
+    std::string head("OpusHead", 8);
+    head += (char) 1;
+    head += (char) 1;
+    append_le(head, pre_skip, 2);
+    append_le(head, sample_rate, 4);
+    /* output gain and channel mapping family */
+    append_le(head, 0, 2);
+    head += (char) 0;
+    add_page(out, head, std::vector<size_t>(1, head.size()), DF_OGG_BEGINNING_OF_STREAM, 0);
+
+    static const char vendor[] = "libdfegrpc";
+    std::string tags("OpusTags", 8);
+    append_le(tags, sizeof(vendor) - 1, 4);
+    tags.append(vendor, sizeof(vendor) - 1);
+    append_le(tags, 0, 4);
+    add_page(out, tags, std::vector<size_t>(1, tags.size()), 0, 0);
+}
+
+void df_opus_encoder::encode(const int16_t *samples, size_t count, std::string& out)
+{
+    if (finished) {
+        return;
+    }
+    if (!headers_written) {
+        write_headers(out);
+        headers_written = true;
+    }
+
+    pending.insert(pending.end(), samples, samples + count);
+
+    size_t used = 0;
+    unsigned char packet[DF_OPUS_MAX_PACKET];
+    for (; pending.size() - used >= frame_samples; used += frame_samples) {
+        int length = encode_frame(encoder, &pending[used], frame_samples, packet, sizeof(packet));
+        samples_encoded += frame_samples;
+        if (length < 0) {
+            continue;
+        }
+        page_body.append((const char *) packet, length);
+        packet_sizes.push_back(length);
+        if (packet_sizes.size() >= DF_OPUS_PACKETS_PER_PAGE) {
+            add_page(out, page_body, packet_sizes, 0, pre_skip + samples_encoded * (48000 / sample_rate));
+            page_body.clear();
+            packet_sizes.clear();
+        }
+    }
+    pending.erase(pending.begin(), pending.begin() + used);
+}
+
+void df_opus_encoder::finish(std::string& out)
+{
+    if (finished) {
+        return;
+    }
+    if (!headers_written) {
+        write_headers(out);
+        headers_written = true;
+    }
+
+    if (!pending.empty()) {
+        /* the padding is encoded but the granule position stops at the real samples, so decoders trim it */
+        unsigned char packet[DF_OPUS_MAX_PACKET];
+        size_t real_samples = pending.size();
+        pending.resize(frame_samples, 0);
+        int length = encode_frame(encoder, pending.data(), frame_samples, packet, sizeof(packet));
+        samples_encoded += real_samples;
+        if (length >= 0) {
+            page_body.append((const char *) packet, length);
+            packet_sizes.push_back(length);
+        }
+        pending.clear();
+    }
+
+    add_page(out, page_body, packet_sizes, DF_OGG_END_OF_STREAM, pre_skip + samples_encoded * (48000 / sample_rate));
+    page_body.clear();
+    packet_sizes.clear();
+    finished = true;
+}
+
+bool df_audio_converter::supports(enum dialogflow_source_audio_format source, enum dialogflow_audio_encoding target)
+{
+    if (source != DF_SOURCE_AUDIO_MULAW && source != DF_SOURCE_AUDIO_ALAW && source != DF_SOURCE_AUDIO_SLIN) {
+        return false;
+    }
+#ifdef HAVE_OPUS
+    if (target == DF_AUDIO_ENCODING_OGG_OPUS) {
+        return true;
+    }
+#endif
+    return target == DF_AUDIO_ENCODING_LINEAR_16 || target == DF_AUDIO_ENCODING_MULAW;
+}
+
+df_audio_converter::df_audio_converter(enum dialogflow_source_audio_format source, int source_rate, enum dialogflow_audio_encoding target, int target_rate, int bitrate) :
+    kernels(df_audio_kernels_best()), source(source), target(target)
+{
+    if (source_rate != target_rate) {
+        resampler.reset(new df_resampler(source_rate, target_rate, kernels));
+    }
+    if (target == DF_AUDIO_ENCODING_OGG_OPUS) {
+        opus.reset(df_opus_encoder::create(target_rate, bitrate));
+    }
+}
+
+const std::string& df_audio_converter::convert(const char *data, size_t length)
+{
+    switch (source) {
+    case DF_SOURCE_AUDIO_MULAW:
+        linear.resize(length);
+        kernels->ulaw_to_linear((const uint8_t *) data, linear.data(), length);
+        break;
+    case DF_SOURCE_AUDIO_ALAW:
+        linear.resize(length);
+        kernels->alaw_to_linear((const uint8_t *) data, linear.data(), length);
+        break;
+    default: {
+        /* a sample split across two writes waits for its other half */
+        size_t total = odd_byte.size() + length;
+        linear.resize(total / 2);
+        if (linear.empty()) {
+            odd_byte.append(data, length);
+            break;
+        }
+        char *destination = (char *) linear.data();
+        size_t used = linear.size() * 2 - odd_byte.size();
+        memcpy(destination, odd_byte.data(), odd_byte.size());
+        memcpy(destination + odd_byte.size(), data, used);
+        odd_byte.assign(data + used, length - used);
+        break;
+    }
+    }
+
+    const int16_t *samples = linear.data();
+    size_t count = linear.size();
+    if (resampler != nullptr) {
+        resampled.clear();
+        resampler->process(samples, count, resampled);
+        samples = resampled.data();
+        count = resampled.size();
+    }
+
+    if (target == DF_AUDIO_ENCODING_OGG_OPUS) {
+        output.clear();
+        if (opus != nullptr) {
+            opus->encode(samples, count, output);
+        }
+    } else if (target == DF_AUDIO_ENCODING_MULAW) {
+        output.resize(count);
+        kernels->linear_to_ulaw(samples, (uint8_t *) &output[0], count);
+    } else {
+        output.assign((const char *) samples, count * sizeof(int16_t));
+    }
+    return output;
+}
+
+const std::string& df_audio_converter::finish()
+{
+    output.clear();
+    if (opus != nullptr) {
+        opus->finish(output);
+    }
+    return output;
+}
@@ -0,0 +1,185 @@
+#ifndef _LIB_DFEGRPC_AUDIO_H_
+#define _LIB_DFEGRPC_AUDIO_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "libdfegrpc.h"
+
+/* the conversion kernels for one instruction set */
+struct df_audio_kernels {
+    const char *name;
+    void (*ulaw_to_linear)(const uint8_t *in, int16_t *out, size_t count);
+    void (*alaw_to_linear)(const uint8_t *in, int16_t *out, size_t count);
+    void (*linear_to_ulaw)(const int16_t *in, uint8_t *out, size_t count);
+    void (*linear_to_alaw)(const int16_t *in, uint8_t *out, size_t count);
+    float (*dot_product)(const float *a, const float *b, size_t count);
+    /* sum of squares, and how many neighbouring samples differ in sign */
+    void (*frame_stats)(const int16_t *in, size_t count, uint64_t *energy, size_t *zero_crossings);
+};
+
+const struct df_audio_kernels *df_audio_kernels_scalar(void);
+/* nullptr when the build or the cpu doesn't support them */
+const struct df_audio_kernels *df_audio_kernels_sse2(void);
+const struct df_audio_kernels *df_audio_kernels_avx2(void);
+/* the fastest set this cpu can run */
+const struct df_audio_kernels *df_audio_kernels_best(void);
+
+/* fills in audio's format fields from the WAV header at the start of data, false if there isn't a complete one.
+   data and length are left alone */
+bool df_parse_wav(const char *data, size_t length, struct dialogflow_output_audio *audio);
+/* puts the samples of 16 bit linear mono output audio into out in the given format, skipping any WAV header. audio without
+   one is taken to be more samples. false for a WAV file of some other kind */
+bool df_convert_output_audio(const char *data, size_t length, enum dialogflow_output_audio_format format, std::string& out);
+
+/* polyphase FIR sample rate converter for a continuous stream of 16 bit samples */
+class df_resampler
+{
+    public:
+    df_resampler(int input_rate, int output_rate, const struct df_audio_kernels *kernels);
+    void process(const int16_t *in, size_t count, std::vector<int16_t>& out);
+
+    private:
+    const struct df_audio_kernels *kernels;
+    int up;
+    int down;
+    size_t taps;
+    /* one set of taps per phase, reversed so each lines up with the input it multiplies */
+    std::vector<float> coefficients;
+    std::vector<float> history;
+    uint64_t position;
+};
+
+/* tells 10ms frames of speech from silence by their energy and zero crossing rate */
+class df_speech_detector
+{
+    public:
+    static bool supports(enum dialogflow_source_audio_format format);
+
+    df_speech_detector(enum dialogflow_source_audio_format format, int sample_rate, int threshold_dbfs);
+    bool is_speech(const char *frame);
+
+    const size_t bytes_per_second;
+    const size_t frame_bytes;
+
+    private:
+    const struct df_audio_kernels *kernels;
+    enum dialogflow_source_audio_format format;
+    double threshold_energy;
+    std::vector<int16_t> linear;
+};
+
+/* holds audio back until it hears speech, then releases it along with a short pre-roll of what came before.
+   after a long enough silence it closes again */
+class df_voice_gate
+{
+    public:
+    df_voice_gate(enum dialogflow_source_audio_format format, int sample_rate, int threshold_dbfs, int pre_roll_ms, int trailing_silence_ms);
+    /* the audio to pass on, valid until the next call */
+    const std::string& process(const char *data, size_t length);
+    bool is_open() const { return open; }
+    size_t suppressed_bytes() const { return suppressed; }
+    double suppressed_seconds() const { return (double) suppressed / detector.bytes_per_second; }
+
+    private:
+    df_speech_detector detector;
+    size_t pre_roll_bytes;
+    int trailing_frames;
+    bool open;
+    int speech_frames;
+    int silent_frames;
+    size_t suppressed;
+    std::string partial_frame;
+    std::string pre_roll;
+    std::string output;
+};
+
+/* finds the end of speech in a stream of audio: speech, then a hangover of silence */
+class df_endpointer
+{
+    public:
+    df_endpointer(enum dialogflow_source_audio_format format, int sample_rate, int threshold_dbfs, int hangover_ms, float min_stability);
+    /* true once the end is reached. with a min_stability the transcript must also be at least that stable
+       (the latest interim stability is passed in), unless the silence goes on for twice the hangover */
+    bool process(const char *data, size_t length, float stability);
+    /* whether the audio given to the last process() had speech in it */
+    bool heard_speech() const { return speech_heard; }
+
+    private:
+    df_speech_detector detector;
+    int hangover_frames;
+    float min_stability;
+    bool speaking;
+    bool speech_heard;
+    bool ended;
+    int speech_frames;
+    int silent_frames;
+    std::string partial_frame;
+};
+
+struct OpusEncoder;
+
+/* encodes 16 bit linear audio into an Ogg Opus stream, 20ms to a packet and a few packets to a page */
+class df_opus_encoder
+{
+    public:
+    /* nullptr when the library was built without opus or the encoder can't be set up for the rate */
+    static df_opus_encoder *create(int sample_rate, int bitrate);
+    ~df_opus_encoder();
+    /* appends whatever pages the samples complete to out. samples short of a whole frame, and packets
+       short of a whole page, wait for the next call or for finish() */
+    void encode(const int16_t *samples, size_t count, std::string& out);
+    /* pads and encodes the last partial frame and appends the final page, marked end of stream with the
+       granule position of the last real sample. nothing more is encoded after it */
+    void finish(std::string& out);
+
+    private:
+    df_opus_encoder(struct OpusEncoder *encoder, int sample_rate, int pre_skip);
+    void write_headers(std::string& out);
+    void add_page(std::string& out, const std::string& body, const std::vector<size_t>& packet_sizes, uint8_t flags, uint64_t granule_position);
+
+    struct OpusEncoder *encoder;
+    int sample_rate;
+    size_t frame_samples;
+    int pre_skip;
+    uint32_t serial;
+    uint32_t page_sequence;
+    uint64_t samples_encoded;
+    bool headers_written;
+    bool finished;
+    std::vector<int16_t> pending;
+    std::string page_body;
+    std::vector<size_t> packet_sizes;
+};
+
+/* turns audio written in a session's source format into its input format, resampling on the way if the rates differ.
+   an OGG_OPUS target compresses the audio on the way out */
+class df_audio_converter
+{
+    public:
+    static bool supports(enum dialogflow_source_audio_format source, enum dialogflow_audio_encoding target);
+
+    df_audio_converter(enum dialogflow_source_audio_format source, int source_rate, enum dialogflow_audio_encoding target, int target_rate, int bitrate = 0);
+    /* false if the opus encoder couldn't be created */
+    bool ok() const { return target != DF_AUDIO_ENCODING_OGG_OPUS || opus != nullptr; }
+    /* the result is valid until the next call */
+    const std::string& convert(const char *data, size_t length);
+    /* whatever is still held back once the last audio is in - the end of an opus stream */
+    const std::string& finish();
+
+    private:
+    const struct df_audio_kernels *kernels;
+    enum dialogflow_source_audio_format source;
+    enum dialogflow_audio_encoding target;
+    std::unique_ptr<df_resampler> resampler;
+    std::unique_ptr<df_opus_encoder> opus;
+    std::string odd_byte;
+    std::vector<int16_t> linear;
+    std::vector<int16_t> resampled;
+    std::string output;
+};
+
+#endif /* _LIB_DFEGRPC_AUDIO_H_ */
@@ -0,0 +1,142 @@
+#include <cstddef>
+#include <cstdint>
+
+#include "libdfegrpc_audio.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+/* only the kernels are built for avx2, so nothing here runs before the cpu check says it may */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+#include "libdfegrpc_audio_kernels.h"
+
+struct avx2_ops {
+    typedef __m256i v;
+    static const size_t lanes = 16;
+
+    static v load_bytes(const uint8_t *p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p)); }
+    /* packing works within each 128 bit half, so gather the two low quarters before storing */
+    static void store_bytes(uint8_t *p, v a) { _mm_storeu_si128((__m128i *) p, _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(a, a), 0x08))); }
+    static v load(const int16_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+    static void store(int16_t *p, v a) { _mm256_storeu_si256((__m256i *) p, a); }
+    static v set1(int16_t x) { return _mm256_set1_epi16(x); }
+    static v and_(v a, v b) { return _mm256_and_si256(a, b); }
+    static v or_(v a, v b) { return _mm256_or_si256(a, b); }
+    static v xor_(v a, v b) { return _mm256_xor_si256(a, b); }
+    static v andnot(v a, v b) { return _mm256_andnot_si256(a, b); }
+    static v add(v a, v b) { return _mm256_add_epi16(a, b); }
+    static v sub(v a, v b) { return _mm256_sub_epi16(a, b); }
+    static v mullo(v a, v b) { return _mm256_mullo_epi16(a, b); }
+    static v mulhi_unsigned(v a, v b) { return _mm256_mulhi_epu16(a, b); }
+    template<int n> static v slli(v a) { return _mm256_slli_epi16(a, n); }
+    template<int n> static v srli(v a) { return _mm256_srli_epi16(a, n); }
+    template<int n> static v srai(v a) { return _mm256_srai_epi16(a, n); }
+    static v cmpeq(v a, v b) { return _mm256_cmpeq_epi16(a, b); }
+    static v cmpgt(v a, v b) { return _mm256_cmpgt_epi16(a, b); }
+    static v min(v a, v b) { return _mm256_min_epi16(a, b); }
+};
+
+static void avx2_ulaw_to_linear(const uint8_t *in, int16_t *out, size_t count)
+{
+    vector_ulaw_to_linear<avx2_ops>(in, out, count);
+}
+
+static void avx2_alaw_to_linear(const uint8_t *in, int16_t *out, size_t count)
+{
+    vector_alaw_to_linear<avx2_ops>(in, out, count);
+}
+
+static void avx2_linear_to_ulaw(const int16_t *in, uint8_t *out, size_t count)
+{
+    vector_linear_to_ulaw<avx2_ops>(in, out, count);
+}
+
+static void avx2_linear_to_alaw(const int16_t *in, uint8_t *out, size_t count)
+{
+    vector_linear_to_alaw<avx2_ops>(in, out, count);
+}
+
+static float avx2_dot_product(const float *a, const float *b, size_t count)
+{
+    __m256 sum = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, half);
+    float total = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; i++) {
+        total += a[i] * b[i];
+    }
+    return total;
+}
+
+static void avx2_frame_stats(const int16_t *in, size_t count, uint64_t *energy, size_t *zero_crossings)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i sum = zero;
+    __m256i crossings = zero;
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i samples = _mm256_loadu_si256((const __m256i *) (in + i));
+        __m256i squares = _mm256_madd_epi16(samples, samples);
+        sum = _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_unpacklo_epi32(squares, zero), _mm256_unpackhi_epi32(squares, zero)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, sum);
+    uint64_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < count; i++) {
+        total += (int32_t) in[i] * in[i];
+    }
+
+    for (i = 1; i + 16 <= count; i += 16) {
+        __m256i changes = _mm256_srai_epi16(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (in + i)), _mm256_loadu_si256((const __m256i *) (in + i - 1))), 15);
+        crossings = _mm256_sub_epi32(crossings, _mm256_madd_epi16(changes, ones));
+    }
+    uint32_t counts[8];
+    _mm256_storeu_si256((__m256i *) counts, crossings);
+    size_t changed = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        changed += counts[lane];
+    }
+    for (; i < count; i++) {
+        if ((in[i] ^ in[i - 1]) & 0x8000) {
+            changed++;
+        }
+    }
+
+    *energy = total;
+    *zero_crossings = changed;
+}
+
+#pragma GCC pop_options
+
+static const struct df_audio_kernels avx2_kernels = {
+    "avx2",
+    avx2_ulaw_to_linear,
+    avx2_alaw_to_linear,
+    avx2_linear_to_ulaw,
+    avx2_linear_to_alaw,
+    avx2_dot_product,
+    avx2_frame_stats
+};
+
+const struct df_audio_kernels *df_audio_kernels_avx2(void)
+{
+    return __builtin_cpu_supports("avx2") ? &avx2_kernels : nullptr;
+}
+
+#else
+
+const struct df_audio_kernels *df_audio_kernels_avx2(void)
+{
+    return nullptr;
+}
+
+#endif
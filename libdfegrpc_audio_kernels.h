@@ -0,0 +1,204 @@
+#ifndef _LIB_DFEGRPC_AUDIO_KERNELS_H_
+#define _LIB_DFEGRPC_AUDIO_KERNELS_H_
+
+/* G.711 conversion kernels written once against a small set of vector operations, then instantiated for each
+   instruction set by the translation unit built for it. everything here has internal linkage so the copies
+   compiled for different instruction sets never get merged by the linker. no standard library templates
+   either, for the same reason */
+
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+/* scalar references, after the classic Sun g711.c. these also finish off whatever doesn't fill a vector */
+inline int16_t scalar_ulaw_to_linear(uint8_t u_val)
+{
+    u_val = ~u_val;
+    int t = ((u_val & 0x0f) << 3) + 0x84;
+    t <<= (u_val & 0x70) >> 4;
+    return (u_val & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+inline int16_t scalar_alaw_to_linear(uint8_t a_val)
+{
+    a_val ^= 0x55;
+    int t = (a_val & 0x0f) << 4;
+    int seg = (a_val & 0x70) >> 4;
+    switch (seg) {
+    case 0:
+        t += 8;
+        break;
+    case 1:
+        t += 0x108;
+        break;
+    default:
+        t += 0x108;
+        t <<= seg - 1;
+    }
+    return (a_val & 0x80) ? t : -t;
+}
+
+inline uint8_t scalar_linear_to_ulaw(int16_t sample)
+{
+    static const int seg_end[8] = { 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff, 0x1fff };
+    int pcm_val = sample >> 2;
+    int mask = 0xff;
+    if (pcm_val < 0) {
+        pcm_val = -pcm_val;
+        mask = 0x7f;
+    }
+    if (pcm_val > 8159) {
+        pcm_val = 8159;
+    }
+    pcm_val += 0x84 >> 2;
+
+    int seg = 0;
+    while (seg < 8 && pcm_val > seg_end[seg]) {
+        seg++;
+    }
+    if (seg >= 8) {
+        return 0x7f ^ mask;
+    }
+    return ((seg << 4) | ((pcm_val >> (seg + 1)) & 0x0f)) ^ mask;
+}
+
+inline uint8_t scalar_linear_to_alaw(int16_t sample)
+{
+    static const int seg_end[8] = { 0x1f, 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff };
+    int pcm_val = sample >> 3;
+    int mask = 0xd5;
+    if (pcm_val < 0) {
+        mask = 0x55;
+        pcm_val = -pcm_val - 1;
+    }
+
+    int seg = 0;
+    while (seg < 8 && pcm_val > seg_end[seg]) {
+        seg++;
+    }
+    int aval = seg << 4;
+    aval |= (pcm_val >> (seg < 2 ? 1 : seg)) & 0x0f;
+    return aval ^ mask;
+}
+
+/* the vector versions work on 16 bit lanes. V supplies the operations for one instruction set:
+   v, lanes, load_bytes, store_bytes, load, store, set1, and_, or_, xor_, andnot (~a & b), add, sub,
+   mullo, mulhi_unsigned, slli<n>, srli<n>, srai<n>, cmpeq, cmpgt, min */
+
+template<typename V> inline typename V::v select(typename V::v mask, typename V::v a, typename V::v b)
+{
+    return V::or_(V::and_(mask, a), V::andnot(mask, b));
+}
+
+/* 1 << e for e in 0..7 */
+template<typename V> inline typename V::v power_of_two(typename V::v e)
+{
+    typename V::v one = V::set1(1);
+    typename V::v two = V::set1(2);
+    typename V::v four = V::set1(4);
+    typename V::v factor = select<V>(V::cmpeq(V::and_(e, one), one), two, one);
+    factor = select<V>(V::cmpeq(V::and_(e, two), two), V::template slli<2>(factor), factor);
+    factor = select<V>(V::cmpeq(V::and_(e, four), four), V::template slli<4>(factor), factor);
+    return factor;
+}
+
+/* how many of the ascending thresholds x exceeds */
+template<typename V> inline typename V::v count_above(typename V::v x, const int16_t *thresholds, int count)
+{
+    typename V::v segment = V::set1(0);
+    for (int i = 0; i < count; i++) {
+        /* the comparison gives -1 per lane */
+        segment = V::sub(segment, V::cmpgt(x, V::set1(thresholds[i])));
+    }
+    return segment;
+}
+
+template<typename V> inline void vector_ulaw_to_linear(const uint8_t *in, int16_t *out, size_t count)
+{
+    size_t i = 0;
+    for (; i + V::lanes <= count; i += V::lanes) {
+        typename V::v u = V::xor_(V::load_bytes(in + i), V::set1(0xff));
+        typename V::v t = V::add(V::template slli<3>(V::and_(u, V::set1(0x0f))), V::set1(0x84));
+        typename V::v e = V::template srli<4>(V::and_(u, V::set1(0x70)));
+        t = V::mullo(t, power_of_two<V>(e));
+        typename V::v negative = V::cmpeq(V::and_(u, V::set1(0x80)), V::set1(0x80));
+        V::store(out + i, select<V>(negative, V::sub(V::set1(0x84), t), V::sub(t, V::set1(0x84))));
+    }
+    for (; i < count; i++) {
+        out[i] = scalar_ulaw_to_linear(in[i]);
+    }
+}
+
+template<typename V> inline void vector_alaw_to_linear(const uint8_t *in, int16_t *out, size_t count)
+{
+    size_t i = 0;
+    for (; i + V::lanes <= count; i += V::lanes) {
+        typename V::v a = V::xor_(V::load_bytes(in + i), V::set1(0x55));
+        typename V::v t = V::template slli<4>(V::and_(a, V::set1(0x0f)));
+        typename V::v e = V::template srli<4>(V::and_(a, V::set1(0x70)));
+        typename V::v first_segment = V::cmpeq(e, V::set1(0));
+        t = V::add(t, select<V>(first_segment, V::set1(8), V::set1(0x108)));
+        /* segments above the first shift by one less than their number */
+        t = V::mullo(t, power_of_two<V>(V::sub(e, V::andnot(first_segment, V::set1(1)))));
+        typename V::v positive = V::cmpeq(V::and_(a, V::set1(0x80)), V::set1(0x80));
+        V::store(out + i, select<V>(positive, t, V::sub(V::set1(0), t)));
+    }
+    for (; i < count; i++) {
+        out[i] = scalar_alaw_to_linear(in[i]);
+    }
+}
+
+template<typename V> inline void vector_linear_to_ulaw(const int16_t *in, uint8_t *out, size_t count)
+{
+    static const int16_t seg_end[8] = { 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff, 0x1fff };
+    size_t i = 0;
+    for (; i + V::lanes <= count; i += V::lanes) {
+        typename V::v pcm = V::template srai<2>(V::load(in + i));
+        typename V::v negative = V::cmpgt(V::set1(0), pcm);
+        typename V::v mask = select<V>(negative, V::set1(0x7f), V::set1(0xff));
+        pcm = select<V>(negative, V::sub(V::set1(0), pcm), pcm);
+        pcm = V::add(V::min(pcm, V::set1(8159)), V::set1(0x84 >> 2));
+
+        typename V::v seg = count_above<V>(pcm, seg_end, 8);
+        /* pcm >> (seg + 1) as the high half of pcm * (1 << (15 - seg)) */
+        typename V::v factor = V::template slli<8>(power_of_two<V>(V::sub(V::set1(7), seg)));
+        typename V::v quantized = V::and_(V::mulhi_unsigned(pcm, factor), V::set1(0x0f));
+        typename V::v value = V::xor_(V::or_(V::template slli<4>(seg), quantized), mask);
+        value = select<V>(V::cmpeq(seg, V::set1(8)), V::xor_(mask, V::set1(0x7f)), value);
+        V::store_bytes(out + i, V::and_(value, V::set1(0xff)));
+    }
+    for (; i < count; i++) {
+        out[i] = scalar_linear_to_ulaw(in[i]);
+    }
+}
+
+template<typename V> inline void vector_linear_to_alaw(const int16_t *in, uint8_t *out, size_t count)
+{
+    static const int16_t seg_end[7] = { 0x1f, 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff };
+    size_t i = 0;
+    for (; i + V::lanes <= count; i += V::lanes) {
+        typename V::v pcm = V::template srai<3>(V::load(in + i));
+        typename V::v positive = V::cmpgt(pcm, V::set1(-1));
+        typename V::v mask = select<V>(positive, V::set1(0xd5), V::set1(0x55));
+        /* -pcm - 1 */
+        pcm = select<V>(positive, pcm, V::xor_(pcm, V::set1(-1)));
+
+        /* a 13 bit magnitude never passes the last segment */
+        typename V::v seg = count_above<V>(pcm, seg_end, 7);
+        /* the first two segments both shift by one */
+        typename V::v shift = V::sub(seg, V::cmpeq(seg, V::set1(0)));
+        /* pcm >> shift as the high half of pcm * (1 << (16 - shift)) */
+        typename V::v factor = V::template slli<8>(power_of_two<V>(V::sub(V::set1(8), shift)));
+        typename V::v quantized = V::and_(V::mulhi_unsigned(pcm, factor), V::set1(0x0f));
+        typename V::v value = V::xor_(V::or_(V::template slli<4>(seg), quantized), mask);
+        V::store_bytes(out + i, V::and_(value, V::set1(0xff)));
+    }
+    for (; i < count; i++) {
+        out[i] = scalar_linear_to_alaw(in[i]);
+    }
+}
+
+}
+
+#endif /* _LIB_DFEGRPC_AUDIO_KERNELS_H_ */
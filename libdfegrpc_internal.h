@@ -1,39 +1,360 @@
 #include <vector>
 #include <string>
 #include <cstdarg>
+#include <cstring>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
 
 #include "libdfegrpc.h"
+#include "libdfegrpc_audio.h"
 
 #include <grpcpp/channel.h>
+#include <grpcpp/client_context.h>
+#include <grpcpp/completion_queue.h>
+#include <grpcpp/alarm.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <google/protobuf/arena.h>
 #include <google/cloud/dialogflow/v2beta1/session.grpc.pb.h>
 #include <google/cloud/texttospeech/v1beta1/cloud_tts.grpc.pb.h>
 
-class df_result
+/* a recognition's results, every slot name and value appended to a few blocks of string table. a block is never
+   grown past what it reserved, so results handed out stay put while more are added, and the blocks carry over from
+   one recognition to the next */
+class df_result_table
 {
     public:
-    struct dialogflow_result result;
-    const std::string slot;
-    const std::string value;
-    const int score;
+    df_result_table();
+    void clear();
+    void add(const char *slot, size_t slot_length, const char *value, size_t value_length, int score);
+    void add(const char *slot, const std::string& value, int score) { add(slot, strlen(slot), value.data(), value.length(), score); }
+    void add(const std::string& slot, const std::string& value, int score) { add(slot.data(), slot.length(), value.data(), value.length(), score); }
+    /* the value isn't copied, the table holds on to it instead */
+    void add_shared(const char *slot, std::shared_ptr<const std::string> value, int score);
+    size_t size() const { return results.size(); }
+    /* valid until the table is cleared */
+    struct dialogflow_result *get(size_t index);
+    /* index of the first result with this name, -1 if there isn't one */
+    int find(const char *name);
+    /* index of the first result at or after position whose name starts with prefix, -1 if there isn't one */
+    int find_prefix(const char *prefix, size_t position);
 
-    df_result(const std::string& slot, const std::string& value, int score) : slot(slot), value(value), score(score)
+    private:
+    const char *store(const char *data, size_t length);
+    void index_names();
+
+    std::vector<std::string> blocks;
+    size_t blocks_used;
+    std::deque<struct dialogflow_result> results;
+    std::vector<std::shared_ptr<const std::string>> shared_values;
+    /* result indexes sorted by name, built on the first lookup */
+    std::vector<size_t> by_name;
+};
+
+/* the parts of a final response the results are flattened from. they point into the response, which is only turned
+   into results a part at a time as the results are read */
+struct df_result_source
+{
+    df_result_source() : alternate_result_count(0), score(0), parts_flattened(0), have_response_bytes(false), have_response_json(false)
+    {
+    }
+
+    /* the whole final response, either a StreamingDetectIntentResponse or a DetectIntentResponse */
+    std::shared_ptr<const google::protobuf::Message> response;
+    std::shared_ptr<const std::string> response_id;
+    std::shared_ptr<const google::cloud::dialogflow::v2beta1::QueryResult> query_result;
+    std::shared_ptr<const google::cloud::dialogflow::v2beta1::StreamingRecognitionResult> recognition_result;
+    int alternate_result_count;
+    int score;
+    int parts_flattened;
+    /* the response serialized and as JSON, made the first time they're asked for */
+    bool have_response_bytes;
+    std::string response_bytes;
+    bool have_response_json;
+    std::string response_json;
+};
+
+/* an event held for a host draining them from the session's event descriptor */
+class df_queued_event
+{
+    public:
+    struct dialogflow_event event;
+    const std::string text;
+    const std::string intent_display_name;
+    const std::string action;
+    const std::string fulfillment_text;
+    const std::string audio;
+
+    df_queued_event(const struct dialogflow_event& event) : event(event),
+        text(event.text ? event.text : ""),
+        intent_display_name(event.intent_display_name ? event.intent_display_name : ""),
+        action(event.action ? event.action : ""),
+        fulfillment_text(event.fulfillment_text ? event.fulfillment_text : ""),
+        audio(event.audio ? event.audio : "", event.audio_len)
+    {
+        this->event.text = event.text ? this->text.c_str() : nullptr;
+        this->event.intent_display_name = event.intent_display_name ? this->intent_display_name.c_str() : nullptr;
+        this->event.action = event.action ? this->action.c_str() : nullptr;
+        this->event.fulfillment_text = event.fulfillment_text ? this->fulfillment_text.c_str() : nullptr;
+        this->event.audio = event.audio ? this->audio.data() : nullptr;
+    }
+};
+
+/* a timeval published through a sequence lock, so getters can read it without taking the session lock.
+   writers are already serialized by the session lock */
+class df_published_time
+{
+    public:
+    df_published_time() : sequence(0), seconds(0), microseconds(0)
+    {
+    }
+    df_published_time& operator=(const timeval& value)
     {
-        this->result.slot = this->slot.c_str();
-        this->result.valueLen = this->value.length();
-        this->result.value = this->value.c_str();
-        this->result.score = score;
-    } 
-    df_result(const std::string& slot, const char *buffer, size_t bufferLen, int score) : slot(slot), value(buffer, bufferLen), score(score)
+        unsigned start = sequence.load(std::memory_order_relaxed);
+        sequence.store(start + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        seconds.store(value.tv_sec, std::memory_order_relaxed);
+        microseconds.store(value.tv_usec, std::memory_order_relaxed);
+        sequence.store(start + 2, std::memory_order_release);
+        return *this;
+    }
+    operator timeval() const
     {
-        this->result.slot = this->slot.c_str();
-        this->result.valueLen = bufferLen;
-        this->result.value = this->value.c_str();
-        this->result.score = score;
-    } 
+        timeval value;
+        unsigned start, end;
+        do {
+            start = sequence.load(std::memory_order_acquire);
+            value.tv_sec = seconds.load(std::memory_order_relaxed);
+            value.tv_usec = microseconds.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            end = sequence.load(std::memory_order_relaxed);
+        } while ((start & 1) || start != end);
+        return value;
+    }
+
+    private:
+    std::atomic<unsigned> sequence;
+    std::atomic<time_t> seconds;
+    std::atomic<suseconds_t> microseconds;
+};
+
+/* one connection to an endpoint */
+struct df_channel_shard {
+    std::shared_ptr<grpc::Channel> channel;
+    std::atomic<int> active_streams;
 };
 
+/* the connections to an endpoint shared by every session using the same credentials */
+struct df_channel_group {
+    std::string endpoint;
+    std::string auth_key;
+    std::vector<std::shared_ptr<df_channel_shard>> shards;
+    int references;
+};
+
+/* the pool of channel groups, one per endpoint and key, released when the last session using one lets go */
+std::string make_channel_pool_key(const std::string& endpoint, const std::string& auth_key);
+std::shared_ptr<df_channel_group> acquire_channel_group(const std::string& key, const std::string& endpoint, const std::string& auth_key);
+void release_channel_group(const std::string& key);
+std::shared_ptr<df_channel_shard> select_channel_shard(df_channel_group& group, const std::string& hash_key, bool add_stream);
+
+/* single producer / single consumer byte ring carrying audio from the media thread calling
+   df_write_audio to whichever completion thread is sending on the stream, without locks */
+class df_audio_ring
+{
+    public:
+    df_audio_ring(size_t capacity);
+    bool write(const char *data, size_t length);
+    size_t read(std::string& destination, size_t max_length);
+    size_t read(char *destination, size_t max_length);
+    size_t readable() const;
+
+    const size_t capacity;
+    std::atomic<size_t> high_water;
+    std::atomic<size_t> dropped_bytes;
+
+    private:
+    std::vector<char> buffer;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+};
+
+/* a message waiting to go out on the stream. on a raw call it's already encoded into buffer */
+struct df_outgoing_message {
+    std::unique_ptr<google::cloud::dialogflow::v2beta1::StreamingDetectIntentRequest> request;
+    grpc::ByteBuffer buffer;
+};
+
+/* a serialized StreamingDetectIntentRequest holding only input_audio, built with a single copy of the samples */
+grpc::ByteBuffer df_encode_audio_packet(const char *samples, size_t length);
+
+/* the responses read during one recognition, parsed into a single arena so the ones the session keeps are shared rather
+   than copied, and all of them are freed together once the recognition is replaced */
+class df_turn_memory
+{
+    public:
+    df_turn_memory();
+    /* only called by the thread reading the stream */
+    google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse *new_response();
+    void response_read();
+
+    std::atomic<size_t> responses;
+    std::atomic<size_t> arena_bytes;
+    /* reads that needed more memory from the heap */
+    std::atomic<size_t> allocations;
+
+    private:
+    google::protobuf::Arena arena;
+};
+
+class df_stream_call;
+
+/* an operation started on a completion queue - its address is the tag given to grpc */
+class df_async_op
+{
+    public:
+    virtual ~df_async_op() {}
+    virtual void complete(bool ok) = 0;
+};
+
+class df_stream_call_op : public df_async_op
+{
+    public:
+    df_stream_call *call;
+    void (df_stream_call::*handler)(bool ok);
+
+    df_stream_call_op(df_stream_call *call, void (df_stream_call::*handler)(bool ok)) : call(call), handler(handler)
+    {
+    }
+    void complete(bool ok) override;
+};
+
+/* a StreamingDetectIntent call driven by the completion queue threads rather than a thread of its own.
+   only one read and one write may be outstanding on the stream, so writes queue up behind each other
+   and Finish is issued once the server is done sending and the last write has completed */
+class df_stream_call : public std::enable_shared_from_this<df_stream_call>
+{
+    public:
+    df_stream_call(struct dialogflow_session *session, std::shared_ptr<df_audio_ring> audio_ring);
+    void set_coalescing(size_t bytes, int max_delay_ms);
+    void set_converter(std::unique_ptr<df_audio_converter> converter) { this->audio_converter = std::move(converter); }
+    void set_voice_gate(std::unique_ptr<df_voice_gate> gate) { this->gate = std::move(gate); }
+    void set_endpointer(std::unique_ptr<df_endpointer> endpointer) { this->local_endpointer = std::move(endpointer); }
+    void set_pre_roll(size_t max_bytes) { pre_roll_limit = max_bytes; }
+    void set_turn_memory(std::shared_ptr<df_turn_memory> memory) { turn_memory = memory; }
+    void start(google::cloud::dialogflow::v2beta1::Sessions::StubInterface *stub, std::shared_ptr<grpc::Channel> raw_channel, grpc::CompletionQueue *cq);
+    bool write(std::unique_ptr<google::cloud::dialogflow::v2beta1::StreamingDetectIntentRequest> request);
+    bool write_audio(const char *samples, size_t length);
+    void writes_done();
+    void pump_writes();
+    bool wants_ring_pump() const;
+    df_audio_ring *ring() const { return audio_ring.get(); }
+    /* only used by the thread writing audio */
+    df_audio_converter *converter() const { return audio_converter.get(); }
+    df_voice_gate *voice_gate() const { return gate.get(); }
+    df_endpointer *endpointer() const { return local_endpointer.get(); }
+    /* held while the converter is in use, since the final flush at writes_done can come from another thread */
+    std::mutex conversion_lock;
+    /* whether audio written before the stream is up still fits in the pre-roll */
+    bool reserve_pre_roll(size_t length);
+    bool packages_audio() const { return coalesce_bytes > 0 || raw_channel != nullptr; }
+    void cancel();
+    bool is_finished();
+    bool flush();
+    bool wait_for_writes(size_t max_pending, int timeout_ms);
+    grpc::Status wait();
+
+    private:
+    friend class df_stream_call_op;
+    void on_start(bool ok);
+    void on_read(bool ok);
+    void on_write(bool ok);
+    void on_writes_done(bool ok);
+    void on_finish(bool ok);
+    void on_coalesce_timer(bool ok);
+    void queue_audio_locked(const char *samples, size_t length);
+    void queue_ring_audio_locked();
+    void queue_coalesced_audio_locked();
+    void start_read_locked();
+    void arm_coalesce_timer_locked();
+    bool ring_ready_locked() const;
+    void pump_writes_locked();
+    void maybe_finish_locked();
+    void release_op();
+
+    struct dialogflow_session *session;
+    std::shared_ptr<df_audio_ring> audio_ring;
+    std::unique_ptr<df_audio_converter> audio_converter;
+    std::unique_ptr<df_voice_gate> gate;
+    std::unique_ptr<df_endpointer> local_endpointer;
+    size_t pre_roll_limit;
+    std::atomic<size_t> pre_roll_used;
+    std::atomic<bool> stream_up;
+    grpc::CompletionQueue *cq;
+    std::shared_ptr<grpc::Channel> raw_channel;
+    std::mutex lock;
+    std::condition_variable cond;
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientAsyncReaderWriterInterface<google::cloud::dialogflow::v2beta1::StreamingDetectIntentRequest, google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse>> stream;
+    std::unique_ptr<grpc::GenericClientAsyncReaderWriter> raw_stream;
+    std::shared_ptr<df_turn_memory> turn_memory;
+    google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse *response;
+    grpc::ByteBuffer response_buffer;
+    std::deque<df_outgoing_message> write_queue;
+    df_stream_call_op start_op;
+    df_stream_call_op read_op;
+    df_stream_call_op write_op;
+    df_stream_call_op writes_done_op;
+    df_stream_call_op finish_op;
+    df_stream_call_op coalesce_op;
+    grpc::Alarm coalesce_timer;
+    std::string coalesce_buffer;
+    size_t coalesce_bytes;
+    int coalesce_delay_ms;
+    std::atomic<bool> coalesce_timer_set;
+    bool coalesce_due;
+    grpc::Status status;
+    int pending_ops;
+    bool started;
+    std::atomic<bool> write_in_flight;
+    bool write_failed;
+    bool writes_done_requested;
+    bool writes_done_sent;
+    bool reads_done;
+    bool finish_started;
+    bool finished;
+};
+
+/* a DetectIntent call for an event started by df_recognize_event_async, finished on a completion queue thread */
+class df_event_call : public df_async_op
+{
+    public:
+    df_event_call(struct dialogflow_session *session) : session(session),
+        response(std::make_shared<google::cloud::dialogflow::v2beta1::DetectIntentResponse>()), finished(false)
+    {
+    }
+    void complete(bool ok) override;
+    void cancel();
+    void wait();
+    bool is_finished();
+
+    struct dialogflow_session *session;
+    grpc::ClientContext context;
+    std::shared_ptr<google::cloud::dialogflow::v2beta1::Sessions::StubInterface> stub;
+    std::unique_ptr<grpc::ClientAsyncResponseReaderInterface<google::cloud::dialogflow::v2beta1::DetectIntentResponse>> reader;
+    std::shared_ptr<google::cloud::dialogflow::v2beta1::DetectIntentResponse> response;
+    grpc::Status status;
+
+    private:
+    std::mutex lock;
+    std::condition_variable cond;
+    bool finished;
+};
+
+/* state, counters and timestamps are atomics so the hot getters and df_write_audio don't need the lock, which
+   guards configuration and results. current_request is swapped with std::atomic_store for the same reason */
 struct dialogflow_session {
     std::mutex lock;
     std::string auth_key;
@@ -41,26 +362,72 @@ struct dialogflow_session {
     std::string session_id;
     std::string project_id;
     std::string model;
-    enum dialogflow_session_state state;
+    std::atomic<enum dialogflow_session_state> state;
 	std::shared_ptr<grpc::Channel> channel;
+    std::string channel_key;
+    std::shared_ptr<df_channel_group> channel_group;
+    std::shared_ptr<df_channel_shard> channel_shard;
+    std::shared_ptr<df_channel_shard> stream_shard;
 	std::shared_ptr<google::cloud::dialogflow::v2beta1::Sessions::Sessions::StubInterface> session;
-    std::shared_ptr<grpc::ClientReaderWriterInterface<google::cloud::dialogflow::v2beta1::StreamingDetectIntentRequest, google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse>> current_request;
-    std::unique_ptr<grpc::ClientContext> context;
+    std::shared_ptr<df_stream_call> current_request;
+    std::shared_ptr<df_event_call> current_event_call;
+    std::shared_ptr<df_audio_ring> audio_ring;
+    size_t audio_ring_size;
+    enum dialogflow_audio_encoding input_encoding;
+    int input_sample_rate;
+    enum dialogflow_source_audio_format source_format;
+    int source_sample_rate;
+    enum dialogflow_output_audio_format output_audio_format;
+    int opus_bitrate;
+    int voice_gate_threshold;
+    int voice_gate_pre_roll_ms;
+    int voice_gate_trailing_ms;
+    int endpointer_threshold;
+    int endpointer_hangover_ms;
+    float endpointer_min_stability;
+    size_t start_pre_roll;
+    size_t coalesce_bytes;
+    int coalesce_delay_ms;
+    bool raw_audio_writes;
+    /* these point into turn_memory */
+    std::shared_ptr<df_turn_memory> turn_memory;
     std::shared_ptr<google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse> transcription_response;
     std::shared_ptr<google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse> final_response;
     std::shared_ptr<google::cloud::dialogflow::v2beta1::StreamingDetectIntentResponse> audio_response;
-    std::vector<std::unique_ptr<df_result>> results;
-    std::thread read_thread;
-    size_t bytesWritten;
-    size_t packetsWritten;
-    int responsesReceived;
+    /* the output audio of the current results, shared with them */
+    std::shared_ptr<const std::string> output_audio;
+    df_result_source result_source;
+    df_result_table results;
+    /* the results haven't been through the call log yet */
+    std::atomic<bool> results_log_pending;
+    std::atomic<bool> event_stop_log_pending;
+    std::atomic<size_t> bytesWritten;
+    std::atomic<size_t> sourceBytesWritten;
+    std::atomic<size_t> suppressedBytes;
+    std::atomic<double> suppressedSeconds;
+    std::atomic<float> transcript_stability;
+    std::atomic<int> end_of_speech_latency;
+    std::atomic<size_t> preRollDroppedBytes;
+    std::atomic<size_t> packetsWritten;
+    std::atomic<int> responsesReceived;
     bool request_sentiment_analysis;
     bool use_external_endpointer;
-    bool debug;
+    std::atomic<bool> debug;
     bool stop_writes_on_final_transcription;
-    bool writes_done;
+    std::atomic<bool> writes_done;
     void *user_data;
-    timeval session_start_time;
-    timeval last_transcription_time;
-    timeval intent_detected_time;
+    /* set by df_close_session_async, after which nothing new is started or written */
+    std::atomic<bool> closing;
+    DF_EVENT_FUNC event_function;
+    int event_fd;
+    std::deque<std::unique_ptr<df_queued_event>> pending_events;
+    std::unique_ptr<df_queued_event> current_event;
+    df_published_time session_start_time;
+    df_published_time last_transcription_time;
+    df_published_time intent_detected_time;
+    /* written by the thread writing audio, whenever the local endpointer hears speech */
+    df_published_time last_speech_time;
 };
+
+/* hands the event to the callback and, once df_get_event_fd has been called, queues it and wakes the descriptor */
+void df_emit_event(struct dialogflow_session *session, const struct dialogflow_event& event);